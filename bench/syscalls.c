@@ -0,0 +1,321 @@
+/**
+ * @file syscalls.c
+ * @brief Counts system calls the server makes per request.
+ *
+ * Runs the server under ptrace and loads it over keep-alive connections,
+ * then with a new connection for every request. System calls of all server
+ * threads made during each phase are divided by the requests in it.
+ *
+ * Usage: syscalls <server binary> [server arguments...]
+ * The server must listen on 127.0.0.1:5000 and serve BENCH_PATH, e.g.:
+ *   syscalls ./main -w 1 -r www
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define BENCH_PORT 5000
+#define BENCH_PATH "/"
+
+enum BenchConfig {
+	// Keep-alive phase: requests are sent on every connection, then their
+	// responses are read, for a number of rounds.
+	KEEPALIVE_CONNS = 64,
+	KEEPALIVE_ROUNDS = 100,
+	// Connections made one at a time, each for a single request.
+	CLOSE_CONNS = 2000,
+	SYSCALLS_MAX = 512,
+};
+
+static const struct {
+	int nr;
+	const char *name;
+} NAMES[] = {
+	{SYS_accept, "accept"},
+	{SYS_accept4, "accept4"},
+	{SYS_fcntl, "fcntl"},
+	{SYS_epoll_ctl, "epoll_ctl"},
+	{SYS_epoll_wait, "epoll_wait"},
+	{SYS_epoll_pwait, "epoll_pwait"},
+	{SYS_io_uring_enter, "io_uring_enter"},
+	{SYS_read, "read"},
+	{SYS_recvfrom, "recvfrom"},
+	{SYS_write, "write"},
+	{SYS_writev, "writev"},
+	{SYS_sendto, "sendto"},
+	{SYS_sendmsg, "sendmsg"},
+	{SYS_sendfile, "sendfile"},
+	{SYS_openat, "openat"},
+	{SYS_fstat, "fstat"},
+	{SYS_newfstatat, "newfstatat"},
+	{SYS_statx, "statx"},
+	{SYS_close, "close"},
+	{SYS_shutdown, "shutdown"},
+	{SYS_setsockopt, "setsockopt"},
+	{SYS_getsockopt, "getsockopt"},
+	{SYS_getpeername, "getpeername"},
+	{SYS_clock_gettime, "clock_gettime"},
+	{SYS_clock_nanosleep, "clock_nanosleep"},
+	{SYS_futex, "futex"},
+};
+
+static const char *syscall_name(int nr)
+{
+	static char buffer[16];
+	for (size_t i = 0; i < sizeof NAMES / sizeof NAMES[0]; ++i)
+		if (NAMES[i].nr == nr)
+			return NAMES[i].name;
+	snprintf(buffer, sizeof buffer, "#%d", nr);
+	return buffer;
+}
+
+static int connect_server(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(BENCH_PORT),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void send_request(int fd, bool keep_alive)
+{
+	char request[256];
+	int len = snprintf(
+		request, sizeof request, "GET %s HTTP/1.1\r\nHost: bench\r\n%s\r\n",
+		BENCH_PATH, keep_alive ? "" : "Connection: close\r\n"
+	);
+	if (write(fd, request, len) != len) {
+		perror("write");
+		exit(1);
+	}
+}
+
+/// @brief Reads a whole response, the body is skipped.
+/// @return false if the connection was closed before it.
+static bool read_response(int fd)
+{
+	static char buffer[1 << 16];
+	int len = 0;
+	char *end = NULL;
+
+	while ((end = memmem(buffer, len, "\r\n\r\n", 4)) == NULL) {
+		int n = read(fd, buffer + len, sizeof buffer - len);
+		if (n <= 0)
+			return false;
+		len += n;
+	}
+
+	long body = 0;
+	char *field = strcasestr(buffer, "\r\nContent-Length:");
+	if (field != NULL && field < end)
+		body = strtol(field + 17, NULL, 10);
+
+	// Only one response is outstanding, so nothing follows its body.
+	long remaining = body - (len - (end + 4 - buffer));
+	while (remaining > 0) {
+		int n = read(fd, buffer, sizeof buffer);
+		if (n <= 0)
+			return false;
+		remaining -= n;
+	}
+	return true;
+}
+
+/// @brief Reads a response, exiting if there is none.
+static void expect_response(int fd)
+{
+	if (!read_response(fd)) {
+		fprintf(stderr, "Connection closed before the response\n");
+		exit(1);
+	}
+}
+
+/// @brief Loads the server, stopping itself at the start of every phase so
+///        that the tracer can take counts.
+static int run_load(void)
+{
+	int fds[KEEPALIVE_CONNS];
+
+	// Wait for the server to start serving. A server of an earlier run may
+	// still hold the port for a moment, and reset connections.
+	bool is_ready = false;
+	for (int i = 0; i < 100 && !is_ready; ++i) {
+		int fd = connect_server();
+		if (fd >= 0) {
+			send_request(fd, false);
+			is_ready = read_response(fd);
+			close(fd);
+		}
+		if (!is_ready)
+			usleep(50000);
+	}
+	if (!is_ready) {
+		fprintf(stderr, "Server is not serving on port %d\n", BENCH_PORT);
+		return 1;
+	}
+
+	for (int i = 0; i < KEEPALIVE_CONNS; ++i)
+		if ((fds[i] = connect_server()) < 0)
+			return 1;
+	raise(SIGSTOP);
+
+	for (int r = 0; r < KEEPALIVE_ROUNDS; ++r) {
+		for (int i = 0; i < KEEPALIVE_CONNS; ++i)
+			send_request(fds[i], true);
+		for (int i = 0; i < KEEPALIVE_CONNS; ++i)
+			expect_response(fds[i]);
+	}
+	for (int i = 0; i < KEEPALIVE_CONNS; ++i)
+		close(fds[i]);
+	raise(SIGSTOP);
+
+	for (int i = 0; i < CLOSE_CONNS; ++i) {
+		int fd = connect_server();
+		if (fd < 0)
+			return 1;
+		send_request(fd, false);
+		expect_response(fd);
+		close(fd);
+	}
+	// Let the server finish closing the last connection.
+	usleep(100000);
+
+	return 0;
+}
+
+/// @brief Prints system calls per request made between two counts, those
+///        made for less than 1% of requests are left out.
+static void report(
+	const char *name, long requests, const uint64_t *start,
+	const uint64_t *end
+)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < SYSCALLS_MAX; ++i)
+		total += end[i] - start[i];
+
+	printf(
+		"%s: %ld requests, %.2f system calls per request\n", name, requests,
+		(double)total / requests
+	);
+	for (int i = 0; i < SYSCALLS_MAX; ++i) {
+		uint64_t n = end[i] - start[i];
+		if (n * 100 >= (uint64_t)requests)
+			printf("  %-16s %8.2f\n", syscall_name(i), (double)n / requests);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <server binary> [arguments...]\n", argv[0]);
+		return 2;
+	}
+
+	pid_t server = fork();
+	if (server == 0) {
+		ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+		raise(SIGSTOP);
+		execv(argv[1], argv + 1);
+		perror("execv");
+		_exit(127);
+	}
+
+	int status = 0;
+	waitpid(server, &status, 0);
+	long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+	               PTRACE_O_EXITKILL;
+	ptrace(PTRACE_SETOPTIONS, server, NULL, options);
+	ptrace(PTRACE_SYSCALL, server, NULL, 0);
+
+	pid_t load = fork();
+	if (load == 0)
+		_exit(run_load());
+
+	// Counts at the start of each phase and at the end.
+	static uint64_t counts[SYSCALLS_MAX];
+	static uint64_t marks[3][SYSCALLS_MAX];
+	int mark = 0;
+	int load_status = 0;
+
+	while (1) {
+		pid_t pid = waitpid(-1, &status, __WALL | WUNTRACED);
+		if (pid < 0) {
+			perror("waitpid");
+			return 1;
+		}
+
+		if (pid == load) {
+			if (WIFSTOPPED(status)) {
+				memcpy(marks[mark++], counts, sizeof counts);
+				kill(load, SIGCONT);
+				continue;
+			}
+			load_status = status;
+			memcpy(marks[mark++], counts, sizeof counts);
+			break;
+		}
+
+		if (!WIFSTOPPED(status)) {
+			if (pid == server) {
+				fprintf(stderr, "Server exited\n");
+				return 1;
+			}
+			continue;
+		}
+
+		int sig = WSTOPSIG(status);
+		int deliver = 0;
+		if (sig == (SIGTRAP | 0x80)) {
+			struct __ptrace_syscall_info info;
+			if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof info, &info) > 0 &&
+			    info.op == PTRACE_SYSCALL_INFO_ENTRY &&
+			    info.entry.nr < SYSCALLS_MAX)
+				counts[info.entry.nr]++;
+		} else if (sig != SIGTRAP && sig != SIGSTOP) {
+			// Signals meant for the server are passed on.
+			deliver = sig;
+		}
+		ptrace(PTRACE_SYSCALL, pid, NULL, deliver);
+	}
+
+	// Its listening socket must be gone before the next run binds the port.
+	// Every traced thread has to be reaped.
+	kill(server, SIGKILL);
+	while (waitpid(-1, NULL, __WALL) > 0 || errno == EINTR)
+		/* nothing */;
+	if (!WIFEXITED(load_status) || WEXITSTATUS(load_status) != 0 ||
+	    mark != 3) {
+		fprintf(stderr, "Load failed\n");
+		return 1;
+	}
+
+	report(
+		"keep-alive", KEEPALIVE_CONNS * KEEPALIVE_ROUNDS, marks[0], marks[1]
+	);
+	report("connection per request", CLOSE_CONNS, marks[1], marks[2]);
+
+	return 0;
+}
@@ -1,22 +1,107 @@
 #ifndef CONSTANTS_H_INCLUDED
 #define CONSTANTS_H_INCLUDED
 
+// Values described as defaults can be changed at startup, see settings.h.
+
 enum IOConfig {
+	// Default size of the smallest buffer in the buffer pool, each size
+	// class is twice the previous one.
 	BUFFER_SIZE = 4096,
+	// Number of buffer size classes, larger buffers are not pooled.
+	BUFFER_CLASSES = 5,
+	// Max number of free buffers kept per size class by each event loop.
+	BUFFER_POOL_FREE_MAX = 64,
+	// Max number of data segments a BufWriter can hold at once.
+	WRITER_SEGMENTS_MAX = 8,
+	// Size of buffer in which small responses to pipelined requests are
+	// collected, so that they can be written together.
+	WRITE_BATCH_SIZE = 16384,
+	// Size of the io_uring submission queue of each event loop.
+	URING_ENTRIES = 4096,
+	// Number and size of buffers each io_uring event loop receives into,
+	// the number must be a power of 2.
+	URING_BUFFERS = 1024,
+	URING_BUFFER_SIZE = 4096,
 };
 
 enum ServerConfig {
-	CONNECTIONS_MAX = 256,
-	BACKLOG_MAX = 64,
+	// Default max number of connections per worker.
+	CONNECTIONS_MAX = 16384,
+	// Max number of addresses a server listens on.
+	LISTENERS_MAX = 16,
+	// Connection table grows by this many connections at a time.
+	CONNECTIONS_CHUNK = 256,
+	// Default length of the listen queue, the kernel caps it at somaxconn.
+	BACKLOG_MAX = 1024,
+	// Max connections accepted per wakeup of an event loop, the rest are
+	// accepted on the next one, so that a flood of them does not hold
+	// back serving others.
+	ACCEPT_BATCH_MAX = 64,
+	// Max connections accepted by io_uring that wait for a free slot.
+	PARKED_MAX = 64,
+	// Connections which waited in the listen queue longer than the target,
+	// in milliseconds, for this long are refused, see OVERLOAD_QUEUE.
+	OVERLOAD_DELAY_TARGET = 50,
+	OVERLOAD_DELAY_INTERVAL = 500,
+	// Default max number of events an epoll loop handles per wakeup.
 	EVENTS_MAX = 64,
+	// Max number of worker threads, each running its own event loop.
+	WORKERS_MAX = 256,
+	// Max number of non-connection FDs watched by an event loop.
+	WATCHERS_MAX = 8,
+	// Resolution of connection timeouts in milliseconds.
+	TIMER_TICK_MS = 100,
 };
 
 enum HTTPConfig {
-	// Max size of request and response headers.
+	// Default max size of request and response headers.
 	HEADER_SIZE_MAX = 8190,
 	URI_SIZE_MAX = 4096,
 	// Max number of header-fields besides those we keep track for.
 	EXTRA_FIELDS_MAX = 64,
+	// Default max number of requests served over a persistent connection.
+	KEEPALIVE_REQUESTS_MAX = 1000,
+	// Default seconds a client has to send a complete request header,
+	// counted from connecting or from the first byte of a request.
+	HEADER_TIMEOUT = 10,
+	// Default seconds a persistent connection can wait for its next request.
+	KEEPALIVE_TIMEOUT = 5,
+	// Default seconds writing a response can go on without any progress.
+	WRITE_TIMEOUT = 30,
+	// Max size of the response body for stats.
+	STATS_BODY_MAX = 16384,
+	// Max number of ranges served for a request, with more of them the
+	// whole file is sent instead.
+	RANGES_MAX = 8,
+	// Size of the buffer for the part headers of a multipart/byteranges
+	// response, if they do not fit the whole file is sent instead.
+	MULTIPART_BUFFER_SIZE = 4096,
+};
+
+enum CacheConfig {
+	// Default max number of open-file entries cached per worker, including
+	// entries for files which were not found.
+	FILE_CACHE_MAX = 1024,
+	// Default memory for file contents and response headers per worker.
+	HOT_CACHE_BUDGET = 64 << 20,
+	// By default only files upto this size are kept in memory.
+	HOT_FILE_SIZE_MAX = 256 << 10,
+	// Number of recently evicted files remembered for re-admission, must be
+	// a power of 2.
+	HOT_GHOST_MAX = 1024,
+};
+
+enum LogConfig {
+	// Size of the log ring buffer of each thread, must be a power of 2.
+	LOG_RING_SIZE = 1 << 20,
+	// Longer log records are truncated.
+	LOG_RECORD_MAX = 1024,
+	// Milliseconds the log writer sleeps between flushes.
+	LOG_FLUSH_INTERVAL = 50,
+	// Max number of threads with a log ring, others write logs directly.
+	LOG_THREADS_MAX = WORKERS_MAX + 4,
+	// Number of phase records kept per thread, must be a power of 2.
+	TRACE_RING_SIZE = 1 << 16,
 };
 
 #endif
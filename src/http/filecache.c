@@ -0,0 +1,462 @@
+/**
+ * @file filecache.c
+ * @brief Open-file cache with inotify based invalidation.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "common.h"
+#include "logger.h"
+#include "memory.h"
+#include "mystr.h"
+#include "http/filecache.h"
+#include "http/hotcache.h"
+
+// Changes which can affect the result of looking up a path.
+#define WATCH_MASK                                                    \
+	(IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+	 IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static const String INDEX_FILE = CSTRING("index.html");
+
+/// @brief A watched directory, found by its watch descriptor for events and
+///        by its path for watching more paths.
+typedef struct WatchedDir {
+	// Path relative to root, stored right after the struct.
+	String path;
+	uint32_t hash;
+	struct WatchedDir *chain_next;
+} WatchedDir;
+
+typedef struct FileCache {
+	int notify_fd;
+	const char *root_path;
+
+	int capacity;
+	int count;
+	// Hash table of entries, number of buckets is a power of 2.
+	CachedFile **buckets;
+	uint32_t bucket_mask;
+	// Most recently used entry is at the head.
+	CachedFile *lru_head;
+	CachedFile *lru_tail;
+
+	// Watched directories indexed by watch descriptor, NULL for unused
+	// descriptors. They are also in a hash table by path, which has at
+	// least as many buckets as directories, a power of 2.
+	WatchedDir **watch_dirs;
+	int watch_cap;
+	WatchedDir **watch_buckets;
+	uint32_t watch_bucket_mask;
+	int watch_cnt;
+} FileCache;
+
+static uint32_t hash_string(String s)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < s.len; ++i) {
+		h ^= (unsigned char)s.data[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void unlink_watched(FileCache *c, WatchedDir *d)
+{
+	WatchedDir **link = &c->watch_buckets[d->hash & c->watch_bucket_mask];
+	while (*link != d)
+		link = &(*link)->chain_next;
+	*link = d->chain_next;
+	c->watch_cnt--;
+}
+
+/// @brief Adds a directory to the hash table, doubling it when it has as
+///        many directories as buckets.
+static void link_watched(FileCache *c, WatchedDir *d)
+{
+	if (c->watch_cnt > (int)c->watch_bucket_mask) {
+		uint32_t mask = c->watch_bucket_mask * 2 + 1;
+		WatchedDir **buckets = ALLOCATE_ARRAY(WatchedDir *, mask + 1);
+		if (buckets == NULL)
+			ERRNO_FATAL("calloc");
+
+		for (uint32_t i = 0; i <= c->watch_bucket_mask; ++i) {
+			while (c->watch_buckets[i] != NULL) {
+				WatchedDir *moved = c->watch_buckets[i];
+				c->watch_buckets[i] = moved->chain_next;
+				moved->chain_next = buckets[moved->hash & mask];
+				buckets[moved->hash & mask] = moved;
+			}
+		}
+		FREE(c->watch_buckets);
+		c->watch_buckets = buckets;
+		c->watch_bucket_mask = mask;
+	}
+
+	WatchedDir **bucket = &c->watch_buckets[d->hash & c->watch_bucket_mask];
+	d->chain_next = *bucket;
+	*bucket = d;
+	c->watch_cnt++;
+}
+
+FileCache *filecache_create(const char *root_path, int capacity)
+{
+	FileCache *c = ALLOCATE(FileCache);
+	if (c == NULL)
+		ERRNO_FATAL("calloc");
+
+	int buckets = 1;
+	while (buckets < 2 * capacity)
+		buckets *= 2;
+
+	c->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (c->notify_fd < 0)
+		ERRNO_FATAL("inotify_init1");
+
+	c->root_path = root_path;
+	c->capacity = capacity;
+	c->bucket_mask = buckets - 1;
+	c->buckets = ALLOCATE_ARRAY(CachedFile *, buckets);
+	if (c->buckets == NULL)
+		ERRNO_FATAL("calloc");
+
+	c->watch_bucket_mask = 63;
+	c->watch_buckets = ALLOCATE_ARRAY(WatchedDir *, c->watch_bucket_mask + 1);
+	if (c->watch_buckets == NULL)
+		ERRNO_FATAL("calloc");
+
+	return c;
+}
+
+int filecache_event_fd(const FileCache *c) { return c->notify_fd; }
+
+static void lru_unlink(FileCache *c, CachedFile *f)
+{
+	if (f->lru_prev)
+		f->lru_prev->lru_next = f->lru_next;
+	else
+		c->lru_head = f->lru_next;
+
+	if (f->lru_next)
+		f->lru_next->lru_prev = f->lru_prev;
+	else
+		c->lru_tail = f->lru_prev;
+
+	f->lru_prev = f->lru_next = NULL;
+}
+
+static void lru_push_front(FileCache *c, CachedFile *f)
+{
+	f->lru_prev = NULL;
+	f->lru_next = c->lru_head;
+	if (c->lru_head)
+		c->lru_head->lru_prev = f;
+	else
+		c->lru_tail = f;
+	c->lru_head = f;
+}
+
+void filecache_release(CachedFile *f)
+{
+	assert(f->refcnt > 0);
+	if (--f->refcnt > 0)
+		return;
+
+	if (f->status == STATUS_OK)
+		close(f->fd);
+	for (int i = 0; i < CODING_COUNT; ++i) {
+		if (f->variants[i] != NULL)
+			filecache_release(f->variants[i]);
+	}
+	FREE(f);
+}
+
+/// @brief Removes an entry from the cache, in-flight users keep it alive.
+static void remove_entry(FileCache *c, CachedFile *f)
+{
+	CachedFile **link = &c->buckets[f->hash & c->bucket_mask];
+	while (*link != f)
+		link = &(*link)->chain_next;
+	*link = f->chain_next;
+
+	lru_unlink(c, f);
+	c->count--;
+	if (f->hot != NULL)
+		hotcache_remove(f->hot);
+	for (int i = 0; i < CODING_COUNT; ++i) {
+		if (f->variants[i] != NULL && f->variants[i]->hot != NULL)
+			hotcache_remove(f->variants[i]->hot);
+	}
+	filecache_release(f);
+}
+
+CachedFile *filecache_get(FileCache *c, String key)
+{
+	uint32_t hash = hash_string(key);
+	CachedFile *f = c->buckets[hash & c->bucket_mask];
+
+	for (; f != NULL; f = f->chain_next) {
+		if (f->hash == hash && string_eq(f->key, key))
+			break;
+	}
+	if (f == NULL)
+		return NULL;
+
+	lru_unlink(c, f);
+	lru_push_front(c, f);
+	f->refcnt++;
+	return f;
+}
+
+/// @brief Allocates an entry, it is not added to the cache.
+static CachedFile *new_entry(String key, const CachedFile *value, int refcnt)
+{
+	// Key is stored right after the entry.
+	CachedFile *f = ALLOCATE_SIZED(sizeof(CachedFile) + key.len);
+	if (f == NULL)
+		ERRNO_FATAL("calloc");
+
+	char *key_data = (char *)(f + 1);
+	memcpy(key_data, key.data, key.len);
+
+	*f = (CachedFile){
+		.status = value->status,
+		.fd = value->fd,
+		.size = value->size,
+		.mtime = value->mtime,
+		.mtime_nsec = value->mtime_nsec,
+		.ino = value->ino,
+		.content_type = value->content_type,
+		.key = STRING(key_data, key.len),
+		.hash = hash_string(key),
+		.refcnt = refcnt,
+	};
+	memcpy(f->variants, value->variants, sizeof f->variants);
+	return f;
+}
+
+CachedFile *filecache_new_variant(String key, const CachedFile *value)
+{
+	// Its file's entry holds the only reference.
+	return new_entry(key, value, 1);
+}
+
+CachedFile *filecache_put(FileCache *c, String key, const CachedFile *value)
+{
+	if (c->count == c->capacity)
+		remove_entry(c, c->lru_tail);
+
+	// One for the cache and one for the caller.
+	CachedFile *f = new_entry(key, value, 2);
+
+	CachedFile **bucket = &c->buckets[f->hash & c->bucket_mask];
+	f->chain_next = *bucket;
+	*bucket = f;
+	lru_push_front(c, f);
+	c->count++;
+
+	return f;
+}
+
+static void invalidate_key(FileCache *c, String key)
+{
+	CachedFile *f = filecache_get(c, key);
+	if (f == NULL)
+		return;
+
+	remove_entry(c, f);
+	filecache_release(f);
+}
+
+/// @brief Invalidates `path` and everything under it, if it is a directory.
+static void invalidate_tree(FileCache *c, String path)
+{
+	CachedFile *next = NULL;
+	for (CachedFile *f = c->lru_head; f != NULL; f = next) {
+		next = f->lru_next;
+
+		// Root directory is the empty path, all keys are under it.
+		bool under = path.len == 0 ||
+		             (f->key.len > path.len && f->key.data[path.len] == '/' &&
+		              !memcmp(f->key.data, path.data, path.len));
+		if (under || string_eq(f->key, path))
+			remove_entry(c, f);
+	}
+}
+
+static void invalidate_all(FileCache *c)
+{
+	while (c->lru_head)
+		remove_entry(c, c->lru_head);
+}
+
+static void handle_event(FileCache *c, const struct inotify_event *ev)
+{
+	if (ev->mask & IN_Q_OVERFLOW) {
+		LOG_WARN("File change events overflowed, clearing file cache");
+		invalidate_all(c);
+		return;
+	}
+	if (ev->wd >= c->watch_cap || c->watch_dirs[ev->wd] == NULL)
+		return;
+
+	WatchedDir *watched = c->watch_dirs[ev->wd];
+	String dir = watched->path;
+
+	// Event is for the watched directory itself.
+	if (ev->len == 0) {
+		invalidate_tree(c, dir);
+		if (ev->mask & IN_IGNORED) {
+			unlink_watched(c, watched);
+			c->watch_dirs[ev->wd] = NULL;
+			FREE(watched);
+		}
+		return;
+	}
+
+	String name = STRING(ev->name, strlen(ev->name));
+	char buffer[PATH_MAX];
+	StringBuilder path = STRING_BUILDER(buffer, sizeof buffer);
+	if (dir.len > 0) {
+		string_append(&path, dir);
+		string_append(&path, CSTRING("/"));
+	}
+	if (!string_append(&path, name)) {
+		invalidate_all(c);
+		return;
+	}
+
+	if (ev->mask & IN_ISDIR)
+		invalidate_tree(c, STRING(path.data, path.len));
+	else
+		invalidate_key(c, STRING(path.data, path.len));
+
+	// A precompressed sibling is a part of its file's entry.
+	for (int i = CODING_IDENTITY + 1; i < CODING_COUNT; ++i) {
+		String suffix = VARIANT_SUFFIXES[i];
+		if (name.len > suffix.len &&
+		    !memcmp(name.data + name.len - suffix.len, suffix.data, suffix.len)) {
+			name.len -= suffix.len;
+			invalidate_key(c, STRING(path.data, path.len - suffix.len));
+			break;
+		}
+	}
+
+	// Directory keys resolve to their index file.
+	if (string_eq(name, INDEX_FILE))
+		invalidate_key(c, dir);
+}
+
+void filecache_handle_events(void *cache)
+{
+	FileCache *c = cache;
+	char buffer[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (1) {
+		ssize_t len = read(c->notify_fd, buffer, sizeof buffer);
+		if (len < 0) {
+			if (is_blocking_error(errno))
+				return;
+			ERRNO_FATAL("read inotify");
+		}
+
+		const struct inotify_event *ev = NULL;
+		for (char *at = buffer; at < buffer + len;
+		     at += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)at;
+			handle_event(c, ev);
+		}
+	}
+}
+
+static bool is_watched(const FileCache *c, String dir)
+{
+	uint32_t hash = hash_string(dir);
+	const WatchedDir *d = c->watch_buckets[hash & c->watch_bucket_mask];
+	for (; d != NULL; d = d->chain_next) {
+		if (d->hash == hash && string_eq(d->path, dir))
+			return true;
+	}
+	return false;
+}
+
+/// @brief Adds a watch for the directory, if not already watched.
+/// @return 0 on success, otherwise an errno value.
+static int watch_dir(FileCache *c, String dir)
+{
+	if (is_watched(c, dir))
+		return 0;
+
+	char path[PATH_MAX];
+	int n = dir.len == 0
+	            ? snprintf(path, sizeof path, "%s", c->root_path)
+	            : snprintf(
+					  path, sizeof path, "%s/%.*s", c->root_path, dir.len,
+					  dir.data
+				  );
+	if (n >= (int)sizeof path)
+		return ENAMETOOLONG;
+
+	int wd = inotify_add_watch(c->notify_fd, path, WATCH_MASK);
+	if (wd < 0)
+		return errno;
+
+	if (wd >= c->watch_cap) {
+		int cap = c->watch_cap ? c->watch_cap : 64;
+		while (cap <= wd)
+			cap *= 2;
+
+		WatchedDir **dirs = realloc(c->watch_dirs, cap * sizeof(WatchedDir *));
+		if (dirs == NULL)
+			ERRNO_FATAL("realloc");
+		memset(
+			dirs + c->watch_cap, 0, (cap - c->watch_cap) * sizeof(WatchedDir *)
+		);
+		c->watch_dirs = dirs;
+		c->watch_cap = cap;
+	}
+
+	// The same directory can be reached using different paths.
+	if (c->watch_dirs[wd] != NULL)
+		return 0;
+
+	WatchedDir *d = ALLOCATE_SIZED(sizeof(WatchedDir) + dir.len);
+	if (d == NULL)
+		ERRNO_FATAL("calloc");
+	char *path_data = (char *)(d + 1);
+	memcpy(path_data, dir.data, dir.len);
+	d->path = STRING(path_data, dir.len);
+	d->hash = hash_string(d->path);
+	link_watched(c, d);
+	c->watch_dirs[wd] = d;
+
+	return 0;
+}
+
+bool filecache_watch_dirs(FileCache *c, String relpath)
+{
+	// Root directory and then every prefix ending before a '/'.
+	for (int i = 0; i == 0 || i < relpath.len; ++i) {
+		if (i != 0 && relpath.data[i] != '/')
+			continue;
+
+		int err = watch_dir(c, STRING(relpath.data, i));
+		// Changes below a missing directory are seen as its creation.
+		if (err == ENOENT || err == ENOTDIR)
+			return true;
+		if (err != 0) {
+			LOG_WARN("Cannot watch directory for changes: %s", strerror(err));
+			return false;
+		}
+	}
+
+	return true;
+}
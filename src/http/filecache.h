@@ -0,0 +1,95 @@
+#ifndef FILECACHE_H_INCLUDED
+#define FILECACHE_H_INCLUDED
+
+#include <time.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "mystr.h"
+#include "http/http.h"
+
+/// @brief Cache of opened files and failed lookups, keyed by the normalized
+///        path relative to the document root. Changes are detected using
+///        inotify, for this all directories leading to a cached path are
+///        watched. A cache is used by a single event loop only.
+typedef struct FileCache FileCache;
+
+/// @brief File name suffixes of precompressed siblings, by ContentCoding.
+static const String VARIANT_SUFFIXES[] = {
+	[CODING_IDENTITY] = CSTRING(""),
+	[CODING_BR] = CSTRING(".br"),
+	[CODING_ZSTD] = CSTRING(".zst"),
+	[CODING_GZIP] = CSTRING(".gz"),
+};
+
+/// @brief Result of looking up a path.
+typedef struct CachedFile {
+	// STATUS_OK if the file was opened, otherwise status code of the error.
+	// Fields below are valid for STATUS_OK only.
+	enum HTTPStatusCode status;
+	int fd;
+	off_t size;
+	time_t mtime;
+	// Sub-second part of the mtime and the inode, for the entity-tag.
+	long mtime_nsec;
+	ino_t ino;
+	String content_type;
+	// In-memory contents of the file, managed by HotCache. Can be NULL.
+	struct HotContent *hot;
+	// Precompressed siblings of the file, like "app.js.gz", by ContentCoding.
+	// NULL if there is none. The entry owns them, they have its content type
+	// and are invalidated along with it.
+	struct CachedFile *variants[CODING_COUNT];
+
+	// Internal fields
+	String key;
+	uint32_t hash;
+	// References held by users plus one while the entry is in the cache.
+	int refcnt;
+	struct CachedFile *chain_next;
+	struct CachedFile *lru_prev;
+	struct CachedFile *lru_next;
+} CachedFile;
+
+/// @brief Creates a file cache.
+/// @param root_path Path of the document root.
+/// @param capacity Max number of entries.
+/// @return The cache, it exits on failure.
+FileCache *filecache_create(const char *root_path, int capacity);
+
+/// @brief Returns the FD which becomes readable on pending change events.
+int filecache_event_fd(const FileCache *c);
+
+/// @brief Reads all pending change events and invalidates affected entries.
+/// @param cache The FileCache, takes a void pointer to be an FDCallback.
+void filecache_handle_events(void *cache);
+
+/// @brief Watches all directories leading to `relpath` for changes, only upto
+///        the first one which does not exist. It must be called before
+///        looking up `relpath` on disk, so that no change is missed.
+/// @param c FileCache
+/// @param relpath Normalized path relative to the document root.
+/// @return false if watching failed, then the lookup must not be cached.
+bool filecache_watch_dirs(FileCache *c, String relpath);
+
+/// @brief Finds the entry for a key and takes a reference to it.
+/// @return The entry or NULL if not found.
+CachedFile *filecache_get(FileCache *c, String key);
+
+/// @brief Adds an entry for a key not in the cache, evicting the least
+///        recently used one if full. The cache owns the fd in `value`.
+/// @param value Result of the lookup, only its public fields are used. The
+///        entry takes over its variants.
+/// @return The new entry, with a reference taken for the caller.
+CachedFile *filecache_put(FileCache *c, String key, const CachedFile *value);
+
+/// @brief Makes an entry for a precompressed sibling, to be one of the
+///        `variants` of the entry put for its file. It owns the fd in `value`.
+/// @param key Path of the sibling.
+/// @param value Result of looking it up, only its public fields are used.
+CachedFile *filecache_new_variant(String key, const CachedFile *value);
+
+/// @brief Drops a reference to the entry, taken by get or put.
+void filecache_release(CachedFile *f);
+
+#endif
@@ -0,0 +1,395 @@
+/**
+ * @file files.c
+ * @brief Locating files requested by clients under the document root.
+ */
+
+#define _GNU_SOURCE // For O_PATH
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "common.h"
+#include "config.h"
+#include "logger.h"
+#include "mystr.h"
+#include "http/http.h"
+#include "http/mime.h"
+#include "http/files.h"
+#include "http/filecache.h"
+#include "server/clock.h"
+
+#define STRING_OF(builder_ptr) STRING((builder_ptr)->data, (builder_ptr)->len)
+
+static const String INDEX_FILE = CSTRING("index.html");
+// Length of the longest of VARIANT_SUFFIXES.
+#define VARIANT_SUFFIX_MAX 4
+
+// Set once at startup and only read afterwards, so shared by all workers.
+static int root_fd = -1;
+static char *root_path = NULL;
+
+// Each event loop has its own cache, NULL if caching is not used.
+static _Thread_local FileCache *cache = NULL;
+
+bool files_set_root(const char *path)
+{
+	int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	// Absolute path is needed for watching directories.
+	if ((root_path = realpath(path, NULL)) == NULL) {
+		close(fd);
+		return false;
+	}
+
+	root_fd = fd;
+	return true;
+}
+
+/// @brief Converts an absolute URI path to a path relative to the document
+///        root, by removing empty and "." segments and resolving "..".
+/// @param path Absolute path, must begin with a '/'.
+/// @param out Relative path is appended to it, it is empty for the root.
+/// @return false if the path goes above the root, has a NUL or is too long.
+static bool normalize_path(String path, StringBuilder *out)
+{
+	int i = 0;
+	while (i < path.len) {
+		while (i < path.len && path.data[i] == '/')
+			i++;
+
+		int start = i;
+		while (i < path.len && path.data[i] != '/') {
+			if (path.data[i] == '\0')
+				return false;
+			i++;
+		}
+
+		String seg = STRING(path.data + start, i - start);
+		if (seg.len == 0 || string_eq(seg, CSTRING(".")))
+			continue;
+
+		if (string_eq(seg, CSTRING(".."))) {
+			if (out->len == 0)
+				return false;
+			// Pop the last segment along with its separator.
+			while (out->len > 0 && out->data[out->len - 1] != '/')
+				out->len--;
+			if (out->len > 0)
+				out->len--;
+			continue;
+		}
+
+		if (out->len > 0 && !string_append(out, CSTRING("/")))
+			return false;
+		if (!string_append(out, seg))
+			return false;
+	}
+
+	return true;
+}
+
+/// @brief Opens a path relative to the document root, it does not let
+///        symlinks or ".." resolve to anything outside of the root.
+static int open_beneath(const char *relpath)
+{
+	struct open_how how = {
+		.flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC,
+		.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+	};
+
+	int fd = syscall(SYS_openat2, root_fd, relpath, &how, sizeof how);
+	// Kernels older than 5.6, the path is already normalized so only
+	// symlinks can point outside of the root.
+	if (fd < 0 && errno == ENOSYS)
+		fd = openat(root_fd, relpath, how.flags);
+
+	return fd;
+}
+
+static enum HTTPStatusCode status_from_errno(int err)
+{
+	switch (err) {
+	case ENOENT:
+	case ENOTDIR:
+	case ENAMETOOLONG:
+		return STATUS_NOT_FOUND;
+	case EACCES:
+	case EPERM:
+	case ELOOP:
+	case EXDEV: // Resolution escaped the document root.
+		return STATUS_FORBIDDEN;
+	case EMFILE:
+	case ENFILE:
+		return STATUS_SERVICE_UNAVAILABLE;
+	default:
+		return STATUS_INTERNAL_ERROR;
+	}
+}
+
+/// @brief Looks up a normalized path on disk.
+/// @param relpath Path relative to root, with space for "/index.html".
+/// @param cacheable Set to false, if the directories leading to the opened
+///        file could not be watched.
+/// @return Result of the lookup
+static CachedFile lookup_file(StringBuilder *relpath, bool *cacheable)
+{
+	if (relpath->len == 0)
+		string_append(relpath, CSTRING("."));
+
+	relpath->data[relpath->len] = '\0';
+	int fd = open_beneath(relpath->data);
+	if (fd < 0)
+		return (CachedFile){.status = status_from_errno(errno)};
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		ERRNO_FATAL("fstat");
+
+	if (S_ISDIR(st.st_mode)) {
+		close(fd);
+
+		relpath->cap += INDEX_FILE.len + 1;
+		string_append(relpath, CSTRING("/"));
+		string_append(relpath, INDEX_FILE);
+		relpath->data[relpath->len] = '\0';
+
+		if (cache != NULL && *cacheable)
+			*cacheable = filecache_watch_dirs(cache, STRING_OF(relpath));
+		if ((fd = open_beneath(relpath->data)) < 0)
+			return (CachedFile){.status = status_from_errno(errno)};
+		if (fstat(fd, &st) < 0)
+			ERRNO_FATAL("fstat");
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		return (CachedFile){.status = STATUS_FORBIDDEN};
+	}
+
+	return (CachedFile){
+		.status = STATUS_OK,
+		.fd = fd,
+		.size = st.st_size,
+		.mtime = st.st_mtime,
+		.mtime_nsec = st.st_mtim.tv_nsec,
+		.ino = st.st_ino,
+		.content_type = mimetype_from_path(STRING_OF(relpath)),
+	};
+}
+
+/// @brief Fills info from a cache entry, it takes over the reference to it.
+static enum HTTPStatusCode use_cached(CachedFile *f, FileInfo *info)
+{
+	enum HTTPStatusCode status = f->status;
+	if (status != STATUS_OK) {
+		filecache_release(f);
+		return status;
+	}
+
+	*info = (FileInfo){
+		.fd = f->fd,
+		.size = f->size,
+		.mtime = f->mtime,
+		.mtime_nsec = f->mtime_nsec,
+		.ino = f->ino,
+		.content_type = f->content_type,
+		.coding = CODING_IDENTITY,
+		.cached = f,
+	};
+	for (int i = 0; i < CODING_COUNT; ++i)
+		info->has_variants |= f->variants[i] != NULL;
+	return STATUS_OK;
+}
+
+/// @brief Opens the precompressed siblings of a file, like "app.js.gz".
+///        Those older than the file are left out, they may be stale.
+/// @param relpath Path of the file, with space after it for any suffix.
+/// @param file Result of looking up the file, its variants are set.
+static void lookup_variants(const StringBuilder *relpath, CachedFile *file)
+{
+	StringBuilder path = *relpath;
+	path.cap = relpath->len + VARIANT_SUFFIX_MAX;
+
+	for (int i = CODING_IDENTITY + 1; i < CODING_COUNT; ++i) {
+		path.len = relpath->len;
+		string_append(&path, VARIANT_SUFFIXES[i]);
+		path.data[path.len] = '\0';
+
+		int fd = open_beneath(path.data);
+		if (fd < 0)
+			continue;
+
+		struct stat st;
+		if (fstat(fd, &st) < 0)
+			ERRNO_FATAL("fstat");
+		if (!S_ISREG(st.st_mode) || st.st_mtime < file->mtime) {
+			close(fd);
+			continue;
+		}
+
+		CachedFile variant = {
+			.status = STATUS_OK,
+			.fd = fd,
+			.size = st.st_size,
+			.mtime = st.st_mtime,
+			.mtime_nsec = st.st_mtim.tv_nsec,
+			.ino = st.st_ino,
+			.content_type = file->content_type,
+		};
+		file->variants[i] = filecache_new_variant(STRING_OF(&path), &variant);
+	}
+
+	relpath->data[relpath->len] = '\0';
+}
+
+FileCache *files_init_cache(int capacity)
+{
+	assert(cache == NULL);
+	cache = filecache_create(root_path, capacity);
+	return cache;
+}
+
+enum HTTPStatusCode files_open(String path, FileInfo *info)
+{
+	assert(root_fd >= 0);
+
+	if (path.len == 0 || path.data[0] != '/')
+		return STATUS_BAD_REQUEST;
+
+	// Space for the relative path, "/index.html", a variant suffix and the
+	// NUL character.
+	char buffer[URI_SIZE_MAX + 16 + VARIANT_SUFFIX_MAX];
+	StringBuilder relpath = STRING_BUILDER(buffer, URI_SIZE_MAX);
+	if (!normalize_path(path, &relpath))
+		return STATUS_FORBIDDEN;
+
+	// Cache is keyed by the normalized path, before resolving directories.
+	String key = STRING_OF(&relpath);
+	if (cache != NULL) {
+		CachedFile *f = filecache_get(cache, key);
+		if (f != NULL)
+			return use_cached(f, info);
+	}
+
+	// Watch before looking up, so that changes after it are not missed.
+	bool cacheable = cache != NULL && filecache_watch_dirs(cache, key);
+	int key_len = relpath.len;
+
+	CachedFile result = lookup_file(&relpath, &cacheable);
+	key.len = key_len;
+
+	// Other errors can be transient, so only missing files are cached.
+	if (result.status == STATUS_NOT_FOUND && cacheable)
+		return use_cached(filecache_put(cache, key, &result), info);
+	if (result.status != STATUS_OK)
+		return result.status;
+	if (cacheable) {
+		// Siblings are looked up once, along with the file.
+		lookup_variants(&relpath, &result);
+		return use_cached(filecache_put(cache, key, &result), info);
+	}
+
+	*info = (FileInfo){
+		.fd = result.fd,
+		.size = result.size,
+		.mtime = result.mtime,
+		.mtime_nsec = result.mtime_nsec,
+		.ino = result.ino,
+		.content_type = result.content_type,
+		.cached = NULL,
+	};
+	return STATUS_OK;
+}
+
+void files_choose_coding(FileInfo *info, const AcceptEncoding *accept)
+{
+	if (!info->has_variants)
+		return;
+
+	// Identity is left only for a coding with a higher quality.
+	enum ContentCoding best = CODING_IDENTITY;
+	int best_q = accept->q[CODING_IDENTITY];
+	for (int i = CODING_IDENTITY + 1; i < CODING_COUNT; ++i) {
+		int q = accept->q[i];
+		if (info->cached->variants[i] == NULL || q == 0)
+			continue;
+		if (q > best_q || (best == CODING_IDENTITY && q == best_q)) {
+			best = i;
+			best_q = q;
+		}
+	}
+	if (best == CODING_IDENTITY)
+		return;
+
+	const CachedFile *v = info->cached->variants[best];
+	info->fd = v->fd;
+	info->size = v->size;
+	info->mtime = v->mtime;
+	info->mtime_nsec = v->mtime_nsec;
+	info->ino = v->ino;
+	info->coding = best;
+}
+
+/// @brief Appends a number in lowercase hex digits.
+static void append_hex(StringBuilder *sb, uint64_t num)
+{
+	char digits[16];
+	int len = 0;
+	do {
+		digits[len++] = "0123456789abcdef"[num & 0xf];
+		num >>= 4;
+	} while (num != 0);
+
+	while (len > 0)
+		sb->data[sb->len++] = digits[--len];
+}
+
+String files_etag(const FileInfo *info, char *buffer)
+{
+	StringBuilder sb = STRING_BUILDER(buffer, ETAG_SIZE_MAX);
+	if (files_has_weak_etag(info))
+		string_append(&sb, CSTRING("W/"));
+
+	string_append(&sb, CSTRING("\""));
+	append_hex(&sb, info->ino);
+	string_append(&sb, CSTRING("-"));
+	append_hex(&sb, info->size);
+	string_append(&sb, CSTRING("-"));
+	append_hex(&sb, info->mtime * 1000000000ull + info->mtime_nsec);
+	string_append(&sb, CSTRING("\""));
+	return STRING(sb.data, sb.len);
+}
+
+bool files_has_weak_etag(const FileInfo *info)
+{
+	return info->mtime >= clock_now() - 1;
+}
+
+CachedFile *files_cached_contents(const FileInfo *info)
+{
+	if (info->cached == NULL || info->coding == CODING_IDENTITY)
+		return info->cached;
+	return info->cached->variants[info->coding];
+}
+
+void files_close(FileInfo *info)
+{
+	if (info->fd < 0)
+		return;
+
+	if (info->cached != NULL)
+		filecache_release(info->cached);
+	else
+		close(info->fd);
+
+	info->fd = -1;
+	info->cached = NULL;
+}
@@ -0,0 +1,79 @@
+#ifndef FILES_H_INCLUDED
+#define FILES_H_INCLUDED
+
+#include <time.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "mystr.h"
+#include "http/http.h"
+#include "http/filecache.h"
+
+// Longest entity-tag: W/"<inode>-<size>-<mtime>", each in up to 16 hex digits.
+#define ETAG_SIZE_MAX 56
+
+/// @brief A regular file opened for serving.
+typedef struct FileInfo {
+	int fd;
+	off_t size;
+	time_t mtime;
+	// Sub-second part of the mtime and the inode, for the entity-tag.
+	long mtime_nsec;
+	ino_t ino;
+	String content_type;
+	// Coding of the contents, other than identity if they are those of a
+	// precompressed sibling, see files_choose_coding.
+	enum ContentCoding coding;
+	// The file has precompressed siblings, so responses for it vary by
+	// Accept-Encoding.
+	bool has_variants;
+	// Cache entry holding the fd, NULL if the fd is owned by this.
+	CachedFile *cached;
+} FileInfo;
+
+/// @brief Sets the directory under which all served files must reside.
+///        It must be called once before any call to `files_open`.
+/// @param path Path of the document root
+/// @return false if the directory cannot be opened.
+bool files_set_root(const char *path);
+
+/// @brief Creates the file cache for the calling thread's event loop.
+///        Without it every `files_open` looks up the file on disk.
+/// @param capacity Max number of entries, see filecache_create.
+/// @return The cache, its event FD must be watched by the event loop.
+FileCache *files_init_cache(int capacity);
+
+/// @brief Opens the regular file identified by a request-URI path.
+///        If path is a directory, then its index.html file is opened.
+///        Paths are resolved only beneath the document root.
+/// @param path Decoded absolute path from the request-URI.
+/// @param info Filled with file info on success, close it using `files_close`.
+/// @return STATUS_OK on success, otherwise the status code for the error.
+enum HTTPStatusCode files_open(String path, FileInfo *info);
+
+/// @brief Switches to the precompressed sibling of the file which the client
+///        accepts best, if any. Siblings are found only for cached files,
+///        when the file is looked up.
+/// @param info File opened by `files_open`.
+/// @param accept Codings accepted by the client.
+void files_choose_coding(FileInfo *info, const AcceptEncoding *accept);
+
+/// @brief Returns the cache entry of the contents, that of the file or of its
+///        precompressed sibling. NULL if the file is not cached.
+CachedFile *files_cached_contents(const FileInfo *info);
+
+/// @brief Formats the entity-tag of the contents from their inode, size and
+///        mtime in nanoseconds, so it differs between precompressed siblings.
+/// @param buffer At least ETAG_SIZE_MAX bytes.
+/// @return The entity-tag, pointing into the buffer.
+String files_etag(const FileInfo *info, char *buffer);
+
+/// @brief Tells if the entity-tag of the contents is weak. It is for contents
+///        modified within the last second: mtime is only as fine as a clock
+///        tick, so a write right after could leave all of the tag the same.
+bool files_has_weak_etag(const FileInfo *info);
+
+/// @brief Closes a file opened by `files_open`, does nothing if already closed.
+void files_close(FileInfo *info);
+
+#endif
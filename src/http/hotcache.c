@@ -0,0 +1,286 @@
+/**
+ * @file hotcache.c
+ * @brief In-memory cache of small files with S3-FIFO eviction.
+ *
+ * New contents enter a small FIFO queue which holds about a tenth of the
+ * budget. Contents evicted from it are moved to the main FIFO queue if they
+ * were accessed more than once, otherwise they are dropped and remembered in
+ * a ghost queue. Contents which are re-added while remembered go straight into
+ * the main queue. Contents at the tail of the main queue are re-inserted at
+ * its head while they have been accessed since the last time, see:
+ * "FIFO queues are all you need for cache eviction", SOSP 2023.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config.h"
+#include "logger.h"
+#include "memory.h"
+#include "mystr.h"
+#include "stats.h"
+#include "http/filecache.h"
+#include "http/hotcache.h"
+
+enum HotQueue {
+	QUEUE_SMALL,
+	QUEUE_MAIN,
+	QUEUE_COUNT,
+};
+
+// Access frequency saturates at this value.
+#define FREQ_MAX 3
+
+// Ghosts are found by hash in chains of buckets, twice as many as ghosts.
+#define GHOST_BUCKETS (2 * HOT_GHOST_MAX)
+#define GHOST_MASK (GHOST_BUCKETS - 1)
+_Static_assert(
+	(HOT_GHOST_MAX & (HOT_GHOST_MAX - 1)) == 0 && HOT_GHOST_MAX < UINT16_MAX,
+	"HOT_GHOST_MAX must be a power of 2 below 2^16"
+);
+
+typedef struct Ghost {
+	uint32_t hash;
+	// Index + 1 of the next ghost in its bucket, 0 at the end.
+	uint16_t next;
+} Ghost;
+
+typedef struct FIFOQueue {
+	// Newest contents are at the head.
+	HotContent *head;
+	HotContent *tail;
+	size_t bytes;
+} FIFOQueue;
+
+typedef struct HotCache {
+	size_t budget;
+	size_t file_size_max;
+	size_t used;
+	FIFOQueue queues[QUEUE_COUNT];
+
+	// Key hashes of contents recently evicted from the small queue, in a
+	// ring where the oldest is replaced. Buckets hold the index + 1 of the
+	// first ghost in their chain, 0 if none.
+	Ghost ghosts[HOT_GHOST_MAX];
+	uint16_t ghost_buckets[GHOST_BUCKETS];
+	int ghost_at;
+	int ghost_cnt;
+} HotCache;
+
+HotCache *hotcache_create(size_t budget, size_t file_size_max)
+{
+	HotCache *c = ALLOCATE(HotCache);
+	if (c == NULL)
+		ERRNO_FATAL("calloc");
+
+	c->budget = budget;
+	c->file_size_max = file_size_max;
+	return c;
+}
+
+static void queue_unlink(HotCache *c, HotContent *h)
+{
+	FIFOQueue *q = &c->queues[h->queue];
+
+	if (h->prev)
+		h->prev->next = h->next;
+	else
+		q->head = h->next;
+
+	if (h->next)
+		h->next->prev = h->prev;
+	else
+		q->tail = h->prev;
+
+	h->prev = h->next = NULL;
+	q->bytes -= h->size;
+}
+
+static void queue_push(HotCache *c, HotContent *h, enum HotQueue queue)
+{
+	FIFOQueue *q = &c->queues[queue];
+
+	h->queue = queue;
+	h->prev = NULL;
+	h->next = q->head;
+	if (q->head)
+		q->head->prev = h;
+	else
+		q->tail = h;
+	q->head = h;
+	q->bytes += h->size;
+}
+
+static bool is_ghost(const HotCache *c, uint32_t hash)
+{
+	for (int i = c->ghost_buckets[hash & GHOST_MASK]; i != 0;
+	     i = c->ghosts[i - 1].next) {
+		if (c->ghosts[i - 1].hash == hash)
+			return true;
+	}
+	return false;
+}
+
+/// @brief Removes a ghost from the chain of its bucket.
+static void unlink_ghost(HotCache *c, int index)
+{
+	uint16_t *link = &c->ghost_buckets[c->ghosts[index].hash & GHOST_MASK];
+	while (*link != index + 1)
+		link = &c->ghosts[*link - 1].next;
+	*link = c->ghosts[index].next;
+}
+
+static void add_ghost(HotCache *c, uint32_t hash)
+{
+	int index = c->ghost_at;
+	if (c->ghost_cnt == HOT_GHOST_MAX)
+		unlink_ghost(c, index);
+	else
+		c->ghost_cnt++;
+
+	uint16_t *bucket = &c->ghost_buckets[hash & GHOST_MASK];
+	c->ghosts[index] = (Ghost){.hash = hash, .next = *bucket};
+	*bucket = index + 1;
+	c->ghost_at = (index + 1) % HOT_GHOST_MAX;
+}
+
+void hotcache_release(HotContent *h)
+{
+	assert(h->refcnt > 0);
+	if (--h->refcnt == 0)
+		FREE(h);
+}
+
+void hotcache_remove(HotContent *h)
+{
+	HotCache *c = h->cache;
+
+	queue_unlink(c, h);
+	c->used -= h->size;
+	stats_set(STAT_HOT_BYTES, c->used);
+	h->file->hot = NULL;
+	h->file = NULL;
+	hotcache_release(h);
+}
+
+/// @brief Evicts a single content as per S3-FIFO.
+static void evict_one(HotCache *c)
+{
+	FIFOQueue *small = &c->queues[QUEUE_SMALL];
+	FIFOQueue *large = &c->queues[QUEUE_MAIN];
+
+	while (1) {
+		if (small->tail && (small->bytes >= c->budget / 10 || !large->tail)) {
+			HotContent *h = small->tail;
+
+			if (h->freq > 1) {
+				h->freq = 0;
+				queue_unlink(c, h);
+				queue_push(c, h, QUEUE_MAIN);
+				continue;
+			}
+
+			add_ghost(c, h->file->hash);
+			hotcache_remove(h);
+		} else {
+			HotContent *h = large->tail;
+			assert(h != NULL);
+
+			if (h->freq > 0) {
+				h->freq--;
+				queue_unlink(c, h);
+				queue_push(c, h, QUEUE_MAIN);
+				continue;
+			}
+
+			hotcache_remove(h);
+		}
+
+		stats_add(STAT_HOT_EVICTIONS, 1);
+		return;
+	}
+}
+
+HotContent *hotcache_get(HotCache *c, CachedFile *f)
+{
+	if ((size_t)f->size > c->file_size_max)
+		return NULL;
+
+	HotContent *h = f->hot;
+	if (h == NULL) {
+		stats_add(STAT_HOT_MISSES, 1);
+		return NULL;
+	}
+
+	stats_add(STAT_HOT_HITS, 1);
+	if (h->freq < FREQ_MAX)
+		h->freq++;
+	h->refcnt++;
+	return h;
+}
+
+/// @brief Reads exactly len bytes from the start of file.
+static bool read_file(int fd, char *buffer, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pread(fd, buffer + done, len - done, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+
+	return true;
+}
+
+HotContent *hotcache_put(HotCache *c, CachedFile *f, String header)
+{
+	assert(f->status == STATUS_OK);
+
+	if (f->hot != NULL || (size_t)f->size > c->file_size_max)
+		return NULL;
+
+	size_t size = sizeof(HotContent) + header.len + f->size;
+	if (size > c->budget)
+		return NULL;
+
+	// Header and body are stored right after the struct.
+	HotContent *h = ALLOCATE_SIZED(size);
+	if (h == NULL)
+		ERRNO_FATAL("calloc");
+
+	char *header_data = (char *)(h + 1);
+	char *body_data = header_data + header.len;
+	memcpy(header_data, header.data, header.len);
+
+	if (!read_file(f->fd, body_data, f->size)) {
+		LOG_WARN("Cannot read file into memory");
+		FREE(h);
+		return NULL;
+	}
+
+	while (c->used + size > c->budget)
+		evict_one(c);
+
+	*h = (HotContent){
+		.header = STRING(header_data, header.len),
+		.body = STRING(body_data, f->size),
+		.cache = c,
+		.file = f,
+		.size = size,
+		// One for the cache and one for the caller.
+		.refcnt = 2,
+	};
+
+	f->hot = h;
+	c->used += size;
+	stats_set(STAT_HOT_BYTES, c->used);
+	queue_push(c, h, is_ghost(c, f->hash) ? QUEUE_MAIN : QUEUE_SMALL);
+
+	return h;
+}
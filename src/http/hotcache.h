@@ -0,0 +1,63 @@
+#ifndef HOTCACHE_H_INCLUDED
+#define HOTCACHE_H_INCLUDED
+
+#include <stdint.h>
+
+#include "common.h"
+#include "mystr.h"
+#include "http/filecache.h"
+
+/// @brief In-memory cache of small files along with their serialized response
+///        header, so that a response can be sent with a single write.
+///        Contents are attached to file cache entries, so they are dropped
+///        whenever the file changes. It keeps the total size within a budget,
+///        using S3-FIFO eviction which does not let one-off scans evict the
+///        frequently used files. A cache is used by a single event loop only.
+///        Hits, misses, evictions and bytes used are counted in stats.h.
+typedef struct HotCache HotCache;
+
+typedef struct HotContent {
+	// Response header without the Date field and the terminating CRLF.
+	String header;
+	String body;
+
+	// Internal fields
+	HotCache *cache;
+	CachedFile *file;
+	// Bytes accounted against the budget.
+	size_t size;
+	// References held by users plus one while it is in the cache.
+	int refcnt;
+	uint8_t freq;
+	uint8_t queue;
+	struct HotContent *prev;
+	struct HotContent *next;
+} HotContent;
+
+/// @brief Creates a hot cache.
+/// @param budget Max bytes used by contents and headers.
+/// @param file_size_max Only files upto this size are kept.
+/// @return The cache, it exits on failure.
+HotCache *hotcache_create(size_t budget, size_t file_size_max);
+
+/// @brief Returns in-memory contents of a file and takes a reference to them.
+///        Lookups are counted as hits or misses for files small enough.
+/// @return Contents or NULL if not in the cache.
+HotContent *hotcache_get(HotCache *c, CachedFile *f);
+
+/// @brief Reads the file contents into the cache, if it is small enough and
+///        not already cached.
+/// @param c HotCache
+/// @param f File, which must have STATUS_OK.
+/// @param header Response header for the file, see HotContent.header.
+/// @return Contents with a reference taken for the caller, or NULL.
+HotContent *hotcache_put(HotCache *c, CachedFile *f, String header);
+
+/// @brief Drops a reference to the contents, taken by get or put.
+void hotcache_release(HotContent *h);
+
+/// @brief Removes the contents from their cache, in-flight users keep them
+///        alive. Used when the file they belong to changes.
+void hotcache_remove(HotContent *h);
+
+#endif
@@ -4,42 +4,34 @@
 #include <string.h>
 #include <locale.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
 
 #include "common.h"
 #include "config.h"
 #include "coroless.h"
 #include "mystr.h"
+#include "stats.h"
+#include "settings.h"
+#include "trace.h"
 #include "io/bufio.h"
+#include "io/bufpool.h"
 #include "server/server.h"
+#include "server/clock.h"
 #include "http/request.h"
 #include "http/parser.h"
+#include "http/files.h"
+#include "http/hotcache.h"
 
-static char message[1 << 16]; // 64 KiB payload: aaaaaaaaaaa...!
-static const String html_mimetype = CSTRING("text/html; charset=utf-8");
+static const String text_mimetype = CSTRING("text/plain; charset=utf-8");
+static const String prometheus_mimetype =
+	CSTRING("text/plain; version=0.0.4; charset=utf-8");
 
-const char *get_local_datetime(void)
-{
-	static char buffer[256];
-	time_t t = time(NULL);
-	strftime(buffer, sizeof buffer, "%F %T", localtime(&t));
-	return buffer;
-}
-
-/// @brief Get datetime in HTTP-datetime format
-/// @return Returns a statically allocated string.
-static String get_http_datetime(void)
-{
-	static char buffer[256];
-
-	time_t t = time(NULL);
-	// <WWW>, <DD> <MMM> <YYYY> <HH>:<MM>:<SS> GMT
-	int len = strftime(
-		buffer, sizeof buffer, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t)
-	);
+// Reserved path for reading the server stats, see stats.h.
+static const String stats_path = CSTRING("/__cnsync/stats");
 
-	assert(len != 0);
-	return (String){.data = buffer, .len = len};
-}
+// Read at startup, they do not change once workers run.
+static Settings settings;
 
 static void
 add_std_header(HTTPHeader *resp, enum HTTPHeaderName hname, String val)
@@ -49,17 +41,21 @@ add_std_header(HTTPHeader *resp, enum HTTPHeaderName hname, String val)
 }
 
 // Append to string builder sb: an unsigned number or String
-#define ADD(num_or_str)                                                          \
-	_Generic(num_or_str, String: string_append, unsigned: string_append_number)( \
-		&strbuf, num_or_str                                                      \
-	)
+#define ADD(num_or_str)                                       \
+	_Generic(                                                 \
+		num_or_str,                                           \
+		String: string_append,                                \
+		unsigned: string_append_number,                       \
+		unsigned long: string_append_number                   \
+	)(&strbuf, num_or_str)
 
 #define APPEND_FIELD(name, value_num_str) \
 	(ADD(name), ADD(CSTRING(": ")), ADD(value_num_str), ADD(CSTRING("\r\n")))
 
-static bool fill_response_header_data(HTTPHeader *resp, unsigned content_length)
+static bool
+fill_response_header_data(HTTPHeader *resp, unsigned long content_length)
 {
-	StringBuilder strbuf = STRING_BUILDER(resp->raw.data, HEADER_SIZE_MAX);
+	StringBuilder strbuf = STRING_BUILDER(resp->raw.data, resp->raw.cap);
 
 	// Response status line
 	ADD(CSTRING(HTTP_VERSION_STR " "));
@@ -79,8 +75,10 @@ static bool fill_response_header_data(HTTPHeader *resp, unsigned content_length)
 		APPEND_FIELD(f.name, f.value);
 	}
 
-	// Add content-length only if it has not been added
-	if (string_is_null(resp->std_fields[HNAME_CONTENT_LENGTH]))
+	// Add content-length only if it has not been added, a 304 response is
+	// only the header.
+	if (string_is_null(resp->std_fields[HNAME_CONTENT_LENGTH]) &&
+	    resp->status != STATUS_NOT_MODIFIED)
 		APPEND_FIELD(HEADER_NAME_STRINGS[HNAME_CONTENT_LENGTH], content_length);
 
 	// End CRLF
@@ -96,97 +94,817 @@ static bool fill_response_header_data(HTTPHeader *resp, unsigned content_length)
 #undef APPEND_FIELD
 #undef ADD
 
+/// @brief Pieces of a multipart/byteranges response besides the ranges of
+///        the file, held in a buffer borrowed from the pool.
+typedef struct Multipart {
+	String content_type;
+	// Header of each part, preceded by its delimiter, and then the closing
+	// delimiter.
+	String delimiters[RANGES_MAX + 1];
+	char data[MULTIPART_BUFFER_SIZE];
+} Multipart;
+
 typedef struct HTTPCoroState {
 	BufReader reader;
 	BufWriter writer;
-	HTTPHeader req;
-	HTTPHeader resp;
+	// Headers and batch are borrowed from the buffer pool while a request is
+	// being received or served, they are NULL while the connection is idle.
+	// Data is received directly into `req->raw`, the request header is at its
+	// start. It is followed by bytes of pipelined requests, `received` is the
+	// length of all of it. Once the header is complete `req->raw.len` is set.
+	HTTPHeader *req;
+	int received;
+	// Bytes of `req->raw` searched for the end of header.
+	int scanned;
+	HTTPHeader *resp;
 	enum HTTPStatusCode status;
+	// Number of requests received over the connection.
+	int request_cnt;
+	// Keep the connection open after the current response.
+	bool keep_alive;
+	// Time at which the first byte of the request was available.
+	uint64_t started_us;
+	// Requested file, fd is -1 if no file is open.
+	FileInfo file;
+	// Body of the response if it is not a file, and its content type.
+	String body;
+	String content_type;
+	// Buffer holding the body of a stats response, borrowed from the pool.
+	char *stats_buffer;
+	// In-memory response for the file, if it is cached.
+	HotContent *hot;
+	char tail_fields[96];
+	// Validators of the file, pointing into the buffers after them.
+	String etag;
+	char etag_data[ETAG_SIZE_MAX];
+	char last_modified[HTTP_DATE_LEN];
+	// Ranges of the file sent in a 206 response and the length of its body.
+	ByteRange ranges[RANGES_MAX];
+	int range_cnt;
+	size_t ranges_len;
+	// Content-Range field of a 206 response with a single range or of a 416,
+	// pointing into the buffer after it.
+	String content_range;
+	char content_range_data[72];
+	// Parts of a 206 response with several ranges, NULL for a single range.
+	// Parts before `part_at` have been put into the writer.
+	Multipart *multipart;
+	int part_at;
+
+	// In-memory pieces of the current response, followed by the file if
+	// `send_file` is set.
+	struct iovec pieces[3];
+	int piece_cnt;
+	bool send_file;
+	// Responses collected for writing together with later ones.
+	StringBuilder batch;
+	// Pending length of the response when the write timeout was last set,
+	// 0 if it is not set.
+	size_t stalled_len;
 } HTTPCoroState;
 
+// Per event loop cache of small files.
+static _Thread_local HotCache *hot_cache = NULL;
+// Boundaries of multipart responses are made from it, it is random to begin
+// with so that they cannot be guessed for putting into a file.
+static _Thread_local uint64_t boundary_seq = 0;
+
+/// @brief Finds the file a request asks for, opening it or its precompressed
+///        sibling which the client accepts.
+/// @return Status code of the response
+static enum HTTPStatusCode find_resource(HTTPHeader *req, FileInfo *file)
+{
+	if (req->method != METHOD_GET && req->method != METHOD_HEAD)
+		return STATUS_NOT_IMPLEMENTED;
+
+	enum HTTPStatusCode status = files_open(req->uri.path, file);
+	if (status == STATUS_OK && file->has_variants) {
+		AcceptEncoding accept =
+			parse_accept_encoding(req->std_fields[HNAME_ACCEPT_ENCODING]);
+		files_choose_coding(file, &accept);
+	}
+	return status;
+}
+
+/// @brief Evaluates the preconditions of a GET or HEAD request for a file.
+///        If-None-Match takes precedence over If-Modified-Since.
+/// @param etag Entity-tag of the file.
+/// @return true if the client's copy is current, so 304 is sent.
+static bool is_not_modified(const HTTPHeader *req, const FileInfo *file, String etag)
+{
+	String tags = req->std_fields[HNAME_IF_NONE_MATCH];
+	if (!string_is_null(tags))
+		return header_has_etag(tags, etag);
+
+	// Dates which are invalid or in the future are ignored.
+	String date = req->std_fields[HNAME_IF_MODIFIED_SINCE];
+	time_t since = 0;
+	return !string_is_null(date) && clock_parse_http_date(date, &since) &&
+	       since <= clock_now() && file->mtime <= since;
+}
+
+/// @brief Tells if the Range of a request applies to the file: its If-Range
+///        validator, if any, must match the current one by strong comparison.
+/// @param etag Entity-tag of the file.
+static bool is_range_current(const HTTPHeader *req, const FileInfo *file, String etag)
+{
+	String validator = req->std_fields[HNAME_IF_RANGE];
+	if (string_is_null(validator))
+		return true;
+
+	// A weak entity-tag starts with "W/", so it fails to parse as a date.
+	if (validator.len > 0 && validator.data[0] == '"')
+		return string_eq(validator, etag);
+
+	// A date is only as strong as the file's entity-tag.
+	time_t date = 0;
+	return clock_parse_http_date(validator, &date) && date == file->mtime &&
+	       !files_has_weak_etag(file);
+}
+
+/// @brief Appends a Content-Range field value, like: "bytes 0-499/1234". It
+///        is "bytes */1234" without a range, for a 416 response.
+/// @return false if there is no space.
+static bool
+append_content_range(StringBuilder *sb, const ByteRange *r, off_t size)
+{
+	bool fits = string_append(sb, CSTRING("bytes "));
+	if (r == NULL)
+		fits = fits && string_append(sb, CSTRING("*"));
+	else
+		fits = fits && string_append_number(sb, r->first) &&
+		       string_append(sb, CSTRING("-")) &&
+		       string_append_number(sb, r->last);
+	return fits && string_append(sb, CSTRING("/")) &&
+	       string_append_number(sb, size);
+}
+
+/// @brief Makes the stats response body, which is in Prometheus format if
+///        the query is "format=prometheus", otherwise it is plain text.
+/// @return Status code of the response
+static enum HTTPStatusCode make_stats_body(
+	HTTPHeader *req, char **buffer, String *body, String *content_type
+)
+{
+	if (req->method != METHOD_GET && req->method != METHOD_HEAD)
+		return STATUS_NOT_IMPLEMENTED;
+
+	bool prometheus = string_eq(req->uri.query, CSTRING("format=prometheus"));
+	*buffer = bufpool_get(STATS_BODY_MAX);
+	StringBuilder sb = STRING_BUILDER(*buffer, STATS_BODY_MAX);
+	if (!stats_format(&sb, prometheus))
+		LOG_WARN("Stats truncated to %d bytes", STATS_BODY_MAX);
+
+	*body = STRING(sb.data, sb.len);
+	*content_type = prometheus ? prometheus_mimetype : text_mimetype;
+	return STATUS_OK;
+}
+
+/// @brief Decides if the connection can serve another request after this.
+/// @param req Request header
+/// @param status Status code of the response
+/// @param request_cnt Number of requests received over the connection.
+static bool
+can_keep_alive(const HTTPHeader *req, enum HTTPStatusCode status, int request_cnt)
+{
+	// Without a parsed header we do not know where the next request begins.
+	if (status == STATUS_BAD_REQUEST || status == STATUS_HEADER_TOO_LARGE)
+		return false;
+
+	// Request bodies are not read, they would be taken as the next request.
+	String length = req->std_fields[HNAME_CONTENT_LENGTH];
+	if (!string_is_null(req->std_fields[HNAME_TRANSFER_ENCODING]) ||
+	    (!string_is_null(length) && !string_eq(length, CSTRING("0"))))
+		return false;
+
+	if (request_cnt >= settings.keepalive_requests_max)
+		return false;
+
+	// Persistent by default for HTTP/1.1 only.
+	String options = req->std_fields[HNAME_CONNECTION];
+	if (header_has_token(options, CSTRING("close")))
+		return false;
+	return req->version == 11 ||
+	       header_has_token(options, CSTRING("keep-alive"));
+}
+
+static String connection_option(bool keep_alive)
+{
+	return keep_alive ? CSTRING("keep-alive") : CSTRING("close");
+}
+
+/// @brief Clears all fields, so that the header can be used again.
+static void reset_response_header(HTTPHeader *resp)
+{
+	memset(resp->std_fields, 0, sizeof(resp->std_fields));
+	resp->extra_field_cnt = 0;
+	resp->raw.len = 0;
+}
+
+/// @brief Returns the in-memory response for a file, caching it if possible.
+/// @param resp Response header with all fields except Connection and Date.
+/// @param file File opened from the file cache.
+/// @return NULL if the file is not in memory.
+static HotContent *get_hot_content(HTTPHeader *resp, FileInfo *file)
+{
+	CachedFile *contents = files_cached_contents(file);
+	HotContent *h = hotcache_get(hot_cache, contents);
+	// Header of a file still being written would keep a weak entity-tag.
+	if (h != NULL || file->size > settings.hot_file_size_max ||
+	    files_has_weak_etag(file))
+		return h;
+
+	if (!fill_response_header_data(resp, file->size))
+		return NULL;
+
+	// Fields which differ between responses are added for each of them.
+	String header = STRING(resp->raw.data, resp->raw.len - 2);
+	return hotcache_put(hot_cache, contents, header);
+}
+
+/// @brief Makes the fields terminating an in-memory response header.
+static int make_tail_fields(char *buffer, int size, bool keep_alive)
+{
+	StringBuilder sb = STRING_BUILDER(buffer, size);
+	string_append(&sb, CSTRING("Connection: "));
+	string_append(&sb, connection_option(keep_alive));
+	string_append(&sb, CSTRING("\r\nDate: "));
+	string_append(&sb, clock_http_date());
+	string_append(&sb, CSTRING("\r\n\r\n"));
+	return sb.len;
+}
+
 #define CV variables->
 
+/// @brief Borrows the buffers for receiving and serving requests.
+static void acquire_buffers(HTTPCoroState *variables)
+{
+	assert(CV req == NULL);
+
+	CV req = bufpool_get(sizeof(HTTPHeader));
+	CV req->raw = STRING_BUILDER(
+		bufpool_get(settings.header_size_max), settings.header_size_max
+	);
+	CV req->first_line = (String){0};
+
+	CV resp = bufpool_get(sizeof(HTTPHeader));
+	CV resp->raw = STRING_BUILDER(
+		bufpool_get(settings.header_size_max), settings.header_size_max
+	);
+	reset_response_header(CV resp);
+
+	CV batch = STRING_BUILDER(bufpool_get(WRITE_BATCH_SIZE), WRITE_BATCH_SIZE);
+}
+
+/// @brief Gives the buffers back to the pool, nothing must be pending in them.
+static void release_buffers(HTTPCoroState *variables)
+{
+	if (CV req == NULL)
+		return;
+
+	bufpool_put(CV req->raw.data, settings.header_size_max);
+	bufpool_put(CV req, sizeof(HTTPHeader));
+	bufpool_put(CV resp->raw.data, settings.header_size_max);
+	bufpool_put(CV resp, sizeof(HTTPHeader));
+	bufpool_put(CV batch.data, WRITE_BATCH_SIZE);
+
+	CV req = CV resp = NULL;
+	CV batch = (StringBuilder){0};
+}
+
+/// @brief Receives more of the request header into `req->raw`. If nothing
+///        of the next request has been received and no data is available,
+///        the buffers are released until it arrives, so that idle
+///        connections do not hold any.
+static int async_read_header(HTTPCoroState *variables)
+{
+	if (CV req == NULL)
+		acquire_buffers(variables);
+
+	int len = async_reader_read(
+		&CV reader, CV req->raw.data + CV received, CV req->raw.cap - CV received
+	);
+	if (len == CORO_PENDING && CV received == 0)
+		release_buffers(variables);
+
+	return len;
+}
+
+/// @brief Writes the queued response, restarting the write timeout whenever
+///        the socket is not ready but some of the response went out.
+static int async_drain_response(HTTPCoroState *variables, Connection *conn)
+{
+	int ret = async_writer_drain(&CV writer);
+	if (ret == CORO_PENDING && CV writer.len != CV stalled_len) {
+		connection_set_timeout(conn, settings.write_timeout * 1000);
+		CV stalled_len = CV writer.len;
+	}
+	return ret;
+}
+
+/// @brief Releases resources held for serving the current request.
+static void release_request(HTTPCoroState *variables)
+{
+	files_close(&CV file);
+	bufpool_put(CV stats_buffer, STATS_BODY_MAX);
+	CV stats_buffer = NULL;
+	if (CV hot != NULL)
+		hotcache_release(CV hot);
+	CV hot = NULL;
+	bufpool_put(CV multipart, sizeof(Multipart));
+	CV multipart = NULL;
+	CV range_cnt = 0;
+	CV content_range = (String){0};
+}
+
+/// @brief Makes the delimiters and part headers of a multipart/byteranges
+///        response for the ranges of the file, and the length of its body.
+/// @return false if they do not fit into the buffer.
+static bool make_multipart(HTTPCoroState *variables)
+{
+	char boundary[17];
+	snprintf(boundary, sizeof boundary, "%016lx", (unsigned long)boundary_seq++);
+	String b = STRING(boundary, 16);
+
+	Multipart *m = CV multipart = bufpool_get(sizeof(Multipart));
+	StringBuilder sb = STRING_BUILDER(m->data, sizeof m->data);
+	bool fits = string_append(&sb, CSTRING("multipart/byteranges; boundary=")) &&
+	            string_append(&sb, b);
+	m->content_type = STRING(sb.data, sb.len);
+
+	CV ranges_len = 0;
+	for (int i = 0; i <= CV range_cnt && fits; ++i) {
+		int start = sb.len;
+		fits = string_append(&sb, CSTRING("\r\n--")) && string_append(&sb, b);
+		if (i == CV range_cnt) {
+			fits = fits && string_append(&sb, CSTRING("--\r\n"));
+		} else {
+			const ByteRange *r = &CV ranges[i];
+			fits = fits && string_append(&sb, CSTRING("\r\nContent-Type: ")) &&
+			       string_append(&sb, CV file.content_type) &&
+			       string_append(&sb, CSTRING("\r\nContent-Range: ")) &&
+			       append_content_range(&sb, r, CV file.size) &&
+			       string_append(&sb, CSTRING("\r\n\r\n"));
+			CV ranges_len += r->last - r->first + 1;
+		}
+		m->delimiters[i] = STRING(sb.data + start, sb.len - start);
+		CV ranges_len += m->delimiters[i].len;
+	}
+
+	CV part_at = 0;
+	return fits;
+}
+
+/// @brief Applies the Range of a GET request for a file. For a 416 response
+///        the file is closed, so that the reason phrase is sent instead.
+/// @return Status code of the response
+static enum HTTPStatusCode select_ranges(HTTPCoroState *variables)
+{
+	String range = CV req->std_fields[HNAME_RANGE];
+	if (CV req->method != METHOD_GET || string_is_null(range) ||
+	    !is_range_current(CV req, &CV file, CV etag))
+		return STATUS_OK;
+
+	int cnt = parse_range(range, CV file.size, CV ranges);
+	if (cnt < 0)
+		return STATUS_OK;
+
+	StringBuilder sb =
+		STRING_BUILDER(CV content_range_data, sizeof CV content_range_data);
+	if (cnt == 0) {
+		append_content_range(&sb, NULL, CV file.size);
+		CV content_range = STRING(sb.data, sb.len);
+		files_close(&CV file);
+		return STATUS_RANGE_NOT_SATISFIABLE;
+	}
+
+	CV range_cnt = cnt;
+	if (cnt == 1) {
+		append_content_range(&sb, &CV ranges[0], CV file.size);
+		CV content_range = STRING(sb.data, sb.len);
+		CV ranges_len = CV ranges[0].last - CV ranges[0].first + 1;
+	} else if (!make_multipart(variables)) {
+		LOG_WARN("Part headers of %d ranges do not fit, sending all", cnt);
+		bufpool_put(CV multipart, sizeof(Multipart));
+		CV multipart = NULL;
+		CV range_cnt = 0;
+		return STATUS_OK;
+	}
+	return STATUS_PARTIAL_CONTENT;
+}
+
+/// @brief Puts the parts of a multipart/byteranges response into the writer,
+///        as many as there is space for. Each part is its header and its
+///        range of the file, the closing delimiter follows the last one.
+static void put_parts(HTTPCoroState *variables)
+{
+	const Multipart *m = CV multipart;
+	while (CV part_at < CV range_cnt && writer_space(&CV writer) >= 2) {
+		const ByteRange *r = &CV ranges[CV part_at];
+		String d = m->delimiters[CV part_at++];
+		writer_put_data(&CV writer, d.data, d.len);
+		writer_put_file(&CV writer, CV file.fd, r->first, r->last - r->first + 1);
+	}
+	if (CV part_at == CV range_cnt && writer_space(&CV writer) >= 1) {
+		String d = m->delimiters[CV part_at++];
+		writer_put_data(&CV writer, d.data, d.len);
+	}
+}
+
+static void add_piece(HTTPCoroState *variables, String data)
+{
+	assert(CV piece_cnt < (int)(sizeof(CV pieces) / sizeof(CV pieces[0])));
+	CV pieces[CV piece_cnt++] = (struct iovec){(char *)data.data, data.len};
+}
+
+/// @brief Moves the in-memory pieces of the response to the batch, if they
+///        fit into it. Pieces are copied, so they can be released after it.
+/// @return true if moved
+static bool batch_pieces(HTTPCoroState *variables)
+{
+	size_t total = 0;
+	for (int i = 0; i < CV piece_cnt; ++i)
+		total += CV pieces[i].iov_len;
+
+	if (total > (size_t)(CV batch.cap - CV batch.len))
+		return false;
+
+	for (int i = 0; i < CV piece_cnt; ++i) {
+		memcpy(CV batch.data + CV batch.len, CV pieces[i].iov_base,
+		       CV pieces[i].iov_len);
+		CV batch.len += CV pieces[i].iov_len;
+	}
+
+	CV piece_cnt = 0;
+	return true;
+}
+
+/// @brief Puts the batched responses and then the current response into the
+///        writer, so that all of them are written together.
+static void put_response(HTTPCoroState *variables)
+{
+	writer_put_data(&CV writer, CV batch.data, CV batch.len);
+	writer_put_iov(&CV writer, CV pieces, CV piece_cnt);
+	if (!CV send_file)
+		return;
+
+	if (CV multipart != NULL)
+		put_parts(variables);
+	else if (CV range_cnt == 1)
+		writer_put_file(&CV writer, CV file.fd, CV ranges[0].first, CV ranges_len);
+	else
+		writer_put_file(&CV writer, CV file.fd, 0, CV file.size);
+}
+
 int handle_http_request(CoroContext *state, Connection *conn)
 {
-	int c = 0, len = 0;
+	int len = 0;
 
 	HTTPCoroState *variables = NULL;
 	CORO_GET_DATA_PTR(state, variables);
 	CORO_BEGIN(state);
 
-	CV reader = (BufReader){.sock_fd = conn->sock_fd, .is_eof = false};
+	CV reader = connection_reader(conn);
 	CV writer = (BufWriter){.sock_fd = conn->sock_fd, .is_closed = false};
-	CV status = STATUS_BAD_REQUEST;
-
-	while (1) {
-		CORO_AWAIT(c, async_reader_getc(&CV reader));
-		if (c == CORO_IO_EOF)
-			break;
+	CV request_cnt = 0;
+	CV file.fd = -1;
+	CV received = 0;
+	CV req = CV resp = NULL;
+	CV multipart = NULL;
+	CV range_cnt = 0;
+	CV content_range = (String){0};
+	acquire_buffers(variables);
+	connection_set_timeout(conn, settings.header_timeout * 1000);
+
+next_request:
+	// Bytes after the previous request are the start of this one.
+	CV received -= CV req->raw.len;
+	memmove(CV req->raw.data, CV req->raw.data + CV req->raw.len, CV received);
+	if (CV received > 0) {
+		TRACE_PHASE(TRACE_FIRST_BYTE);
+		CV started_us = stats_time_us();
+	}
 
-		if (CV req.raw.len == HEADER_SIZE_MAX) {
+	CV status = STATUS_BAD_REQUEST;
+	CV req->raw.len = 0;
+	CV req->method = METHOD_UNKNOWN;
+	CV req->first_line = (String){0};
+	reset_response_header(CV resp);
+	CV body = (String){0};
+	CV content_type = text_mimetype;
+
+	CV scanned = 0;
+	while (!(CV req->raw.len =
+	             find_header_end(CV req->raw.data, CV received, CV scanned))) {
+		if (CV received == settings.header_size_max) {
 			CV status = STATUS_HEADER_TOO_LARGE;
 			break;
 		}
-		CV req.raw.data[CV req.raw.len++] = c;
 
-		if (c == '\n' && is_request_header_end(&CV req))
+		// Only the new bytes are searched next time.
+		CV scanned = CV received;
+		CORO_AWAIT(len, async_read_header(variables));
+		if (len == CORO_IO_EOF)
 			break;
+		if (CV received == 0) {
+			TRACE_PHASE(TRACE_FIRST_BYTE);
+			CV started_us = stats_time_us();
+			// The first request is timed from connecting instead.
+			if (CV request_cnt > 0)
+				connection_set_timeout(conn, settings.header_timeout * 1000);
+		}
+		CV received += len;
 	}
+	// Incomplete header is passed on as it is, it fails to parse.
+	if (CV req->raw.len == 0)
+		CV req->raw.len = CV received;
+	connection_set_timeout(conn, 0);
 
-	if (CV req.raw.len == 0)
+	if (CV req->raw.len == 0)
 		goto conn_closed;
 
-	if (parse_request(&CV req))
-		CV status = STATUS_OK;
+	if (CV status != STATUS_HEADER_TOO_LARGE && parse_request(CV req)) {
+		if (string_eq(CV req->uri.path, stats_path))
+			CV status = make_stats_body(
+				CV req, &CV stats_buffer, &CV body, &CV content_type
+			);
+		else
+			CV status = find_resource(CV req, &CV file);
+	}
+	if (CV file.fd >= 0) {
+		CV etag = files_etag(&CV file, CV etag_data);
+		if (is_not_modified(CV req, &CV file, CV etag))
+			CV status = STATUS_NOT_MODIFIED;
+		else
+			CV status = select_ranges(variables);
+	}
+	TRACE_PHASE(TRACE_HEADER_PARSED);
+
+	CV request_cnt++;
+	CV keep_alive = can_keep_alive(CV req, CV status, CV request_cnt);
+
+	if (CV req->first_line.len > 0)
+		LOG_ACCESS(
+			"[%s] %d -- \"%.*s\"", clock_log_time(), CV status,
+			CV req->first_line.len, CV req->first_line.data
+		);
 
-	if (CV req.first_line.len > 0)
-		PRINTE(
-			"[%s] %d -- \"%.*s\"\n", get_local_datetime(), CV status,
-			CV req.first_line.len, CV req.first_line.data
+	// For errors the reason phrase is sent as the body.
+	if (CV multipart != NULL)
+		CV content_type = CV multipart->content_type;
+	else if (CV file.fd >= 0)
+		CV content_type = CV file.content_type;
+	else if (string_is_null(CV body))
+		CV body = STATUS_CODE_STRINGS[CV status];
+
+	unsigned long body_len = CV body.len;
+	if (CV file.fd >= 0)
+		body_len = CV range_cnt > 0 ? CV ranges_len : (unsigned long)CV file.size;
+
+	CV resp->status = CV status;
+	add_std_header(CV resp, HNAME_SERVER, CSTRING("cnsync"));
+	if (CV stats_buffer != NULL)
+		add_std_header(CV resp, HNAME_CACHE_CONTROL, CSTRING("no-store"));
+	if (CV status != STATUS_NOT_MODIFIED) {
+		add_std_header(CV resp, HNAME_CONTENT_TYPE, CV content_type);
+		if (CV file.fd >= 0 && CV file.coding != CODING_IDENTITY)
+			add_std_header(
+				CV resp, HNAME_CONTENT_ENCODING,
+				CONTENT_CODING_STRINGS[CV file.coding]
+			);
+		if (CV file.fd >= 0)
+			add_std_header(CV resp, HNAME_ACCEPT_RANGES, CSTRING("bytes"));
+	}
+	if (!string_is_null(CV content_range))
+		add_std_header(CV resp, HNAME_CONTENT_RANGE, CV content_range);
+	if (CV file.fd >= 0) {
+		add_std_header(CV resp, HNAME_ETAG, CV etag);
+		add_std_header(
+			CV resp, HNAME_LAST_MODIFIED,
+			clock_format_http_date(CV file.mtime, CV last_modified)
 		);
+		if (CV file.has_variants)
+			add_std_header(CV resp, HNAME_VARY, CSTRING("Accept-Encoding"));
+	}
 
-	CV resp.status = CV status;
-	add_std_header(&CV resp, HNAME_CONTENT_TYPE, html_mimetype);
-	add_std_header(&CV resp, HNAME_SERVER, CSTRING("cnsync"));
-	add_std_header(&CV resp, HNAME_DATE, get_http_datetime());
+	if (CV status == STATUS_OK && CV file.cached != NULL)
+		CV hot = get_hot_content(CV resp, &CV file);
 
-	if (!fill_response_header_data(&CV resp, sizeof(message)))
-		goto conn_closed;
+	CV piece_cnt = 0;
+	CV send_file = false;
 
-	writer_put_data(&CV writer, CV resp.raw.data, CV resp.raw.len);
-	CORO_AWAIT(len, async_writer_drain(&CV writer));
-	if (CV writer.is_closed)
-		goto conn_closed;
+	if (CV hot != NULL) {
+		int tail_len = make_tail_fields(
+			CV tail_fields, sizeof CV tail_fields, CV keep_alive
+		);
+		add_piece(variables, CV hot->header);
+		add_piece(variables, STRING(CV tail_fields, tail_len));
+		// Do not write body if HEAD method
+		if (CV req->method != METHOD_HEAD)
+			add_piece(variables, CV hot->body);
+	} else {
+		add_std_header(CV resp, HNAME_DATE, clock_http_date());
+		add_std_header(
+			CV resp, HNAME_CONNECTION, connection_option(CV keep_alive)
+		);
+		if (!fill_response_header_data(CV resp, body_len))
+			goto conn_closed;
+
+		add_piece(variables, STRING(CV resp->raw.data, CV resp->raw.len));
+		// Do not write body if HEAD method, a 304 response has none either.
+		bool has_body = CV req->method != METHOD_HEAD &&
+		                CV status != STATUS_NOT_MODIFIED;
+		if (has_body && CV file.fd >= 0)
+			CV send_file = true;
+		else if (has_body)
+			add_piece(variables, CV body);
+	}
 
-	// Do not write body if HEAD method
-	if (CV req.method == METHOD_HEAD)
-		goto conn_closed;
+	// Response to a pipelined request is held back while more requests are
+	// buffered, then all of them are written with a single system call.
+	if (!CV send_file && batch_pieces(variables) && CV keep_alive &&
+	    find_header_end(
+			CV req->raw.data + CV req->raw.len, CV received - CV req->raw.len, 0
+		))
+		goto response_sent;
+
+	put_response(variables);
+	CV stalled_len = 0;
+	CORO_AWAIT(len, async_drain_response(variables, conn));
+	// Parts of a multipart response which did not fit into the writer.
+	while (CV multipart != NULL && CV part_at <= CV range_cnt &&
+	       !CV writer.is_closed) {
+		put_parts(variables);
+		CORO_AWAIT(len, async_drain_response(variables, conn));
+	}
+	CV batch.len = 0;
 
-	writer_put_data(&CV writer, message, sizeof(message));
-	CORO_AWAIT(len, async_writer_drain(&CV writer));
-	if (CV writer.is_closed)
+response_sent:
+	stats_count_request(CV status, stats_time_us() - CV started_us);
+	release_request(variables);
+	if (!CV keep_alive || CV writer.is_closed)
 		goto conn_closed;
 
+	// Bytes after the request are the start of the next one, otherwise the
+	// connection is idle until it arrives.
+	if (CV received > CV req->raw.len)
+		connection_set_timeout(conn, settings.header_timeout * 1000);
+	else
+		connection_set_timeout(conn, settings.keepalive_timeout * 1000);
+	goto next_request;
+
 conn_closed:
+	release_request(variables);
+	release_buffers(variables);
 	close_connection(conn);
 	CORO_END();
 }
 
+/// @brief Releases resources of a request that was aborted by the server.
+void abort_http_request(CoroContext *state, Connection *conn)
+{
+	(void)conn;
+	HTTPCoroState *variables = NULL;
+	CORO_GET_DATA_PTR(state, variables);
+
+	release_request(variables);
+	release_buffers(variables);
+}
+
 #undef CV
 
-int main(void)
+/// @brief Sets up per-loop state used for serving requests.
+static void init_http_worker(Server *s)
+{
+	FileCache *cache = files_init_cache(settings.file_cache_max);
+	server_watch_fd(
+		s, filecache_event_fd(cache), filecache_handle_events, cache
+	);
+
+	hot_cache = hotcache_create(
+		settings.hot_cache_budget, settings.hot_file_size_max
+	);
+
+	if (getrandom(&boundary_seq, sizeof boundary_seq, 0) < 0)
+		ERRNO_FATAL("getrandom");
+}
+
+// Sent to connections refused while the server is overloaded.
+static const char overload_response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                        "Server: cnsync\r\n"
+                                        "Retry-After: 1\r\n"
+                                        "Content-Length: 0\r\n"
+                                        "Connection: close\r\n\r\n";
+
+/// @brief Sets settings given as: key=value,...
+/// @return false if any of them is invalid.
+static bool set_socket_options(char *spec)
 {
-	IPv4Address addr = {127, 0, 0, 1, 5000};
-	Server *s = server_create(addr);
-	if (s == NULL) {
-		LOG_FATAL("Cannot create server");
-		return 2;
+	for (char *item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+		char *value = strchr(item, '=');
+		if (value == NULL) {
+			LOG_FATAL("Expected key=value: %s", item);
+			return false;
+		}
+		*value++ = '\0';
+		if (!settings_set(&settings, item, value))
+			return false;
 	}
+	return true;
+}
+
+// Keys of the settings which options on the command line set.
+static const struct {
+	char opt;
+	const char *key;
+} OPTION_KEYS[] = {
+	{'a', "listen"},  {'w', "workers"}, {'c', "connections"}, {'r', "root"},
+	{'l', "log"},     {'e', "backend"}, {'o', "overload"},
+};
 
-	memset(message, 'a', sizeof message);
-	message[sizeof message - 1] = '!';
+static void print_usage(const char *prog)
+{
+	PRINTE("Usage: %s [-f config] [-a addresses] [-w workers] [-c connections] [-r root]\n"
+	       "          [-l logfile] [-e backend] [-o overload] [-s key=value,...] [-g key=value]\n", prog);
+	PRINTE("  -f  Config file with a setting per line as: key = value. Other options\n"
+	       "      override it, whatever their order.\n");
+	PRINTE("  -a  Addresses to listen on, default is 127.0.0.1:5000.\n");
+	PRINTE("  -w  Number of worker threads, default is number of CPUs.\n");
+	PRINTE("  -c  Max connections per worker, default is %d.\n", CONNECTIONS_MAX);
+	PRINTE("  -r  Directory to serve files from, default is current directory.\n");
+	PRINTE("  -l  File to append logs to, default is stderr.\n");
+	PRINTE("  -e  Event backend: epoll or io_uring, default is epoll.\n");
+	PRINTE("  -o  When all connections are in use: refuse (503), reset or queue,\n"
+	       "      default is refuse.\n");
+	PRINTE("  -s  Socket options: backlog, defer (seconds), fastopen (queue length),\n"
+	       "      nodelay (0 or 1), sndbuf and rcvbuf (bytes). Default is\n"
+	       "      backlog=%d,nodelay=1.\n", BACKLOG_MAX);
+	PRINTE("  -g  Sets any of the settings below, it can be repeated.\n");
+	PRINTE("Settings:\n");
+	settings_print_keys();
+}
+
+int main(int argc, char **argv)
+{
+	static const char *const optstring = "f:a:w:c:r:l:e:o:s:g:h";
+	settings_init(&settings);
+
+	// The config file is read first, so that options override it.
+	int opt = 0;
+	while ((opt = getopt(argc, argv, optstring)) != -1) {
+		if (opt == 'f' && !settings_load(&settings, optarg))
+			return 2;
+		if (opt == 'h' || opt == '?') {
+			print_usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+
+	optind = 1;
+	while ((opt = getopt(argc, argv, optstring)) != -1) {
+		const char *key = NULL;
+		for (size_t i = 0; i < sizeof OPTION_KEYS / sizeof OPTION_KEYS[0]; ++i)
+			if (OPTION_KEYS[i].opt == opt)
+				key = OPTION_KEYS[i].key;
+
+		if (key != NULL) {
+			if (!settings_set(&settings, key, optarg))
+				return 2;
+		} else if (opt == 's') {
+			if (!set_socket_options(optarg))
+				return 2;
+		} else if (opt == 'g') {
+			char *value = strchr(optarg, '=');
+			if (value == NULL) {
+				LOG_FATAL("Expected key=value: %s", optarg);
+				return 2;
+			}
+			*value++ = '\0';
+			if (!settings_set(&settings, optarg, value))
+				return 2;
+		}
+	}
 
-	server_listen(s, handle_http_request, sizeof(HTTPCoroState));
+	const char *log_path = settings.log_path[0] ? settings.log_path : NULL;
+	if (!log_start(log_path))
+		ERRNO_FATAL("log file");
+
+	if (!files_set_root(settings.root))
+		ERRNO_FATAL("document root");
+	LOG_INFO("Serving files from %s", settings.root);
+
+	bufpool_set_size(settings.buffer_size);
+
+	ServerHandler handler = {
+		.callback = handle_http_request,
+		.abort = abort_http_request,
+		.data_size = sizeof(HTTPCoroState),
+		.worker_init = init_http_worker,
+		.overload = settings.overload,
+		.overload_response = overload_response,
+		.overload_response_len = sizeof overload_response - 1,
+	};
+	server_run_workers(&settings.server, &handler);
 
 	return 0;
 }
@@ -7,10 +7,14 @@
 #ifndef HTTP_H_INCLUDED
 #define HTTP_H_INCLUDED
 
+#include <sys/types.h>
+
 #include "mystr.h"
 #include "common.h"
+#include "config.h"
 
-#define HTTP_VERSION_STR "HTTP/1.0"
+// Version sent in responses, we serve HTTP/1.0 and HTTP/1.1 requests.
+#define HTTP_VERSION_STR "HTTP/1.1"
 
 enum HTTPMethod {
 	// Get a resource identified by request-URI.
@@ -35,6 +39,7 @@ enum HTTPStatusCode {
 	STATUS_CREATED = 201,
 	STATUS_ACCEPTED = 202,
 	STATUS_NO_CONTENT = 204,
+	STATUS_PARTIAL_CONTENT = 206,
 	STATUS_MOVED_PERMA = 301,
 	STATUS_MOVED_TEMP = 302,
 	STATUS_NOT_MODIFIED = 304,
@@ -49,6 +54,7 @@ enum HTTPStatusCode {
 
 	// Extension status codes
 	STATUS_TEAPOT = 418,
+	STATUS_RANGE_NOT_SATISFIABLE = 416,
 	STATUS_HEADER_TOO_LARGE = 431,
 	STATUS_VERSION_UNSUPPORTED = 505,
 };
@@ -58,6 +64,7 @@ static const String STATUS_CODE_STRINGS[] = {
 	[STATUS_CREATED] = CSTRING("Created"),
 	[STATUS_ACCEPTED] = CSTRING("Accepted"),
 	[STATUS_NO_CONTENT] = CSTRING("No Content"),
+	[STATUS_PARTIAL_CONTENT] = CSTRING("Partial Content"),
 	[STATUS_MOVED_PERMA] = CSTRING("Movec Permanently"),
 	[STATUS_MOVED_TEMP] = CSTRING("Moved Temporarily"),
 	[STATUS_NOT_MODIFIED] = CSTRING("Not Modified"),
@@ -66,6 +73,7 @@ static const String STATUS_CODE_STRINGS[] = {
 	[STATUS_FORBIDDEN] = CSTRING("Forbidden"),
 	[STATUS_NOT_FOUND] = CSTRING("Not Found"),
 	[STATUS_TEAPOT] = CSTRING("I'm a Teapot"),
+	[STATUS_RANGE_NOT_SATISFIABLE] = CSTRING("Range Not Satisfiable"),
 	[STATUS_HEADER_TOO_LARGE] = CSTRING("Request Header Too Large"),
 	[STATUS_INTERNAL_ERROR] = CSTRING("Internal Server Error"),
 	[STATUS_NOT_IMPLEMENTED] = CSTRING("Not Implemented"),
@@ -124,6 +132,32 @@ enum HTTPHeaderName {
 	// For host identification, has value <hostname>[:<port>]
 	HNAME_HOST,
 
+	// ------ HTTP/1.1 header fields ------
+	// Options for the connection, like close or keep-alive.
+	HNAME_CONNECTION,
+	// Encodings applied to the body for transfer, like chunked.
+	HNAME_TRANSFER_ENCODING,
+	// Content-codings acceptable in the response, like: br, gzip;q=0.8
+	HNAME_ACCEPT_ENCODING,
+	// Range units supported by the server for the resource, like: bytes.
+	HNAME_ACCEPT_RANGES,
+	// Caching directives for requests and responses, like: no-cache.
+	HNAME_CACHE_CONTROL,
+	// Byte range of the full body enclosed in a 206(Partial Content) response.
+	HNAME_CONTENT_RANGE,
+	// Opaque validator of the representation, like: "5f2a-1c8".
+	HNAME_ETAG,
+	// Used with GET method, the server returns 304(Not Modified) if any of the
+	// listed entity-tags match the current one.
+	HNAME_IF_NONE_MATCH,
+	// Range is applied only if the validator still matches, otherwise the
+	// whole resource is sent.
+	HNAME_IF_RANGE,
+	// Byte ranges of the resource requested instead of the whole of it.
+	HNAME_RANGE,
+	// Request header fields which were used to select the representation.
+	HNAME_VARY,
+
 	HNAME_COUNT,
 };
 
@@ -145,19 +179,62 @@ static const String HEADER_NAME_STRINGS[] = {
 	[HNAME_REFERER] = CSTRING("Referer"),
 	[HNAME_USER_AGENT] = CSTRING("User-Agent"),
 	[HNAME_HOST] = CSTRING("Host"),
+	[HNAME_CONNECTION] = CSTRING("Connection"),
+	[HNAME_TRANSFER_ENCODING] = CSTRING("Transfer-Encoding"),
+	[HNAME_ACCEPT_ENCODING] = CSTRING("Accept-Encoding"),
+	[HNAME_ACCEPT_RANGES] = CSTRING("Accept-Ranges"),
+	[HNAME_CACHE_CONTROL] = CSTRING("Cache-Control"),
+	[HNAME_CONTENT_RANGE] = CSTRING("Content-Range"),
+	[HNAME_ETAG] = CSTRING("ETag"),
+	[HNAME_IF_NONE_MATCH] = CSTRING("If-None-Match"),
+	[HNAME_IF_RANGE] = CSTRING("If-Range"),
+	[HNAME_RANGE] = CSTRING("Range"),
+	[HNAME_VARY] = CSTRING("Vary"),
+};
+
+/// @brief Content-codings of precompressed files, in the order we prefer
+///        them when a client accepts several equally.
+enum ContentCoding {
+	CODING_IDENTITY,
+	CODING_BR,
+	CODING_ZSTD,
+	CODING_GZIP,
+	CODING_COUNT,
 };
 
+static const String CONTENT_CODING_STRINGS[] = {
+	[CODING_IDENTITY] = CSTRING("identity"),
+	[CODING_BR] = CSTRING("br"),
+	[CODING_ZSTD] = CSTRING("zstd"),
+	[CODING_GZIP] = CSTRING("gzip"),
+};
+
+/// @brief Qualities of content-codings given by Accept-Encoding, indexed by
+///        ContentCoding. They are in thousandths, 0 means not acceptable.
+typedef struct AcceptEncoding {
+	uint16_t q[CODING_COUNT];
+} AcceptEncoding;
+
+/// @brief Range of bytes of a representation, both positions are included.
+typedef struct ByteRange {
+	off_t first;
+	off_t last;
+} ByteRange;
+
 typedef struct HeaderField {
 	String name;
 	String value;
 } HeaderField;
 
+/// @brief Parts of a request-URI, they point into the header data.
+/// The path is percent-decoded, if it had any percent encoded characters it
+/// points into a per-thread buffer instead, which is valid only until the
+/// next request is parsed on the same thread.
 typedef struct RequestURI {
 	String full;
 	String path;
 	String query;
 	String segment;
-	DEF_STRING_BUFFER(raw, URI_SIZE_MAX);
 } RequestURI;
 
 /// @brief HTTP header data, can be used for both request and response.
@@ -179,7 +256,8 @@ typedef struct HTTPHeader {
 
 	// Points to the first line of header data, used only for requests.
 	String first_line;
-	DEF_STRING_BUFFER(raw, HEADER_SIZE_MAX);
+	// Header data, the buffer is provided by the user of the header.
+	StringBuilder raw;
 } HTTPHeader;
 
 #endif
@@ -0,0 +1,72 @@
+#ifndef MIME_H_INCLUDED
+#define MIME_H_INCLUDED
+
+#include "mystr.h"
+
+typedef struct MimeType {
+	String extension;
+	String type;
+} MimeType;
+
+static const String DEFAULT_MIMETYPE = CSTRING("application/octet-stream");
+
+// Extensions are matched ignoring case, textual types are assumed to be UTF-8.
+static const MimeType MIME_TYPES[] = {
+	{CSTRING("html"), CSTRING("text/html; charset=utf-8")},
+	{CSTRING("htm"), CSTRING("text/html; charset=utf-8")},
+	{CSTRING("css"), CSTRING("text/css; charset=utf-8")},
+	{CSTRING("js"), CSTRING("text/javascript; charset=utf-8")},
+	{CSTRING("mjs"), CSTRING("text/javascript; charset=utf-8")},
+	{CSTRING("json"), CSTRING("application/json")},
+	{CSTRING("map"), CSTRING("application/json")},
+	{CSTRING("xml"), CSTRING("application/xml")},
+	{CSTRING("txt"), CSTRING("text/plain; charset=utf-8")},
+	{CSTRING("md"), CSTRING("text/markdown; charset=utf-8")},
+	{CSTRING("csv"), CSTRING("text/csv; charset=utf-8")},
+	{CSTRING("wasm"), CSTRING("application/wasm")},
+	{CSTRING("pdf"), CSTRING("application/pdf")},
+	{CSTRING("zip"), CSTRING("application/zip")},
+	{CSTRING("gz"), CSTRING("application/gzip")},
+	{CSTRING("tar"), CSTRING("application/x-tar")},
+	{CSTRING("png"), CSTRING("image/png")},
+	{CSTRING("jpg"), CSTRING("image/jpeg")},
+	{CSTRING("jpeg"), CSTRING("image/jpeg")},
+	{CSTRING("gif"), CSTRING("image/gif")},
+	{CSTRING("webp"), CSTRING("image/webp")},
+	{CSTRING("avif"), CSTRING("image/avif")},
+	{CSTRING("svg"), CSTRING("image/svg+xml")},
+	{CSTRING("ico"), CSTRING("image/x-icon")},
+	{CSTRING("woff"), CSTRING("font/woff")},
+	{CSTRING("woff2"), CSTRING("font/woff2")},
+	{CSTRING("ttf"), CSTRING("font/ttf")},
+	{CSTRING("otf"), CSTRING("font/otf")},
+	{CSTRING("mp3"), CSTRING("audio/mpeg")},
+	{CSTRING("ogg"), CSTRING("audio/ogg")},
+	{CSTRING("wav"), CSTRING("audio/wav")},
+	{CSTRING("mp4"), CSTRING("video/mp4")},
+	{CSTRING("webm"), CSTRING("video/webm")},
+};
+
+/// @brief Finds the mimetype of a file from the extension in its path.
+/// @param path File path
+/// @return Mimetype, `DEFAULT_MIMETYPE` if the extension is not known.
+static inline String mimetype_from_path(String path)
+{
+	int at = path.len;
+	while (at > 0 && path.data[at - 1] != '.' && path.data[at - 1] != '/')
+		at--;
+
+	if (at == 0 || path.data[at - 1] != '.')
+		return DEFAULT_MIMETYPE;
+
+	String ext = STRING(path.data + at, path.len - at);
+	int cnt = sizeof(MIME_TYPES) / sizeof(MIME_TYPES[0]);
+	for (int i = 0; i < cnt; ++i) {
+		if (string_eq_case(ext, MIME_TYPES[i].extension))
+			return MIME_TYPES[i].type;
+	}
+
+	return DEFAULT_MIMETYPE;
+}
+
+#endif
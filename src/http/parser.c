@@ -1,10 +1,12 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "config.h"
+#include "logger.h"
 #include "mystr.h"
 #include "http/http.h"
 #include "http/parser.h"
@@ -49,15 +51,216 @@ typedef struct Scanner {
 			return false;             \
 	} while (0)
 
-// Functions for different character classes we want
-static inline int is_name_char(int c)
+// Character classes the scanner can skip over.
+enum CharClass {
+	// Alphanumeric, '_' and '-'
+	CLASS_NAME,
+	// Printable characters other than space
+	CLASS_URI,
+	// Anything other than '\r' and '\n'
+	CLASS_NOT_CRLF,
+	CLASS_COUNT,
+};
+
+static inline bool in_class(enum CharClass cls, unsigned char c)
+{
+	switch (cls) {
+	case CLASS_NAME:
+		return ('0' <= c && c <= '9') || ('a' <= (c | 0x20) && (c | 0x20) <= 'z') ||
+		       c == '_' || c == '-';
+	case CLASS_URI:
+		return 0x21 <= c && c <= 0x7e;
+	case CLASS_NOT_CRLF:
+		return c != '\r' && c != '\n';
+	default:
+		return false;
+	}
+}
+
+/// @brief Finds the first character in [at, end) not in the class.
+/// @return Pointer to the character or `end` if all are in the class.
+typedef const char *(*SpanFunc)(const char *at, const char *end, enum CharClass cls);
+
+static const char *span_scalar(const char *at, const char *end, enum CharClass cls)
+{
+	while (at < end && in_class(cls, *at))
+		at++;
+	return at;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// Ranges of characters in each class for SSE4.2 range comparison.
+static const char CLASS_RANGES[CLASS_COUNT][16] = {
+	[CLASS_NAME] = "09AZaz__--",
+	[CLASS_URI] = "\x21\x7e",
+	[CLASS_NOT_CRLF] = "\x00\x09\x0b\x0c\x0e\xff",
+};
+
+static const int CLASS_RANGES_LEN[CLASS_COUNT] = {
+	[CLASS_NAME] = 10,
+	[CLASS_URI] = 2,
+	[CLASS_NOT_CRLF] = 6,
+};
+
+__attribute__((target("sse4.2"))) static const char *
+span_sse42(const char *at, const char *end, enum CharClass cls)
+{
+	__m128i ranges = _mm_loadu_si128((const __m128i *)CLASS_RANGES[cls]);
+	int ranges_len = CLASS_RANGES_LEN[cls];
+
+	for (; end - at >= 16; at += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)at);
+		// Index of the first character outside all the ranges, 16 if none.
+		int i = _mm_cmpestri(
+			ranges, ranges_len, chunk, 16,
+			_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY |
+				_SIDD_LEAST_SIGNIFICANT
+		);
+		if (i != 16)
+			return at + i;
+	}
+
+	return span_scalar(at, end, cls);
+}
+
+/// @brief Mask of bytes of x which lie in the range [lo, hi].
+__attribute__((target("avx2"))) static inline __m256i
+range_mask(__m256i x, char lo, char hi)
+{
+	__m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
+	__m256i width = _mm256_set1_epi8((char)(hi - lo));
+	return _mm256_cmpeq_epi8(_mm256_min_epu8(d, width), d);
+}
+
+__attribute__((target("avx2"))) static const char *
+span_avx2(const char *at, const char *end, enum CharClass cls)
+{
+	for (; end - at >= 32; at += 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)at);
+		__m256i match;
+
+		switch (cls) {
+		case CLASS_NAME:
+			match = _mm256_or_si256(
+				_mm256_or_si256(
+					range_mask(chunk, '0', '9'),
+					range_mask(
+						_mm256_or_si256(chunk, _mm256_set1_epi8(0x20)), 'a', 'z'
+					)
+				),
+				_mm256_or_si256(
+					_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('_')),
+					_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('-'))
+				)
+			);
+			break;
+		case CLASS_URI:
+			match = range_mask(chunk, 0x21, 0x7e);
+			break;
+		default:
+			match = _mm256_xor_si256(
+				_mm256_or_si256(
+					_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\r')),
+					_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n'))
+				),
+				_mm256_set1_epi8(-1)
+			);
+			break;
+		}
+
+		uint32_t outside = ~(uint32_t)_mm256_movemask_epi8(match);
+		if (outside != 0)
+			return at + __builtin_ctz(outside);
+	}
+
+	return span_sse42(at, end, cls);
+}
+#endif
+
+static SpanFunc span_class = span_scalar;
+
+/// @brief Picks the widest scanning routine supported by the CPU.
+__attribute__((constructor)) static void select_span_func(void)
 {
-	return isalnum(c) || c == '_' || c == '-';
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		span_class = span_avx2;
+	else if (__builtin_cpu_supports("sse4.2"))
+		span_class = span_sse42;
+#endif
 }
 
-static inline int is_uri_char(int c) { return isgraph(c); }
+// Slots in the header name table, a power of 2 well above HNAME_COUNT.
+#define HNAME_TABLE_BITS 7
+
+// Perfect hash table of standard header names, it has HNAME_* + 1 for
+// the name hashing to a slot and 0 for empty slots.
+static uint8_t hname_table[1 << HNAME_TABLE_BITS];
+static uint32_t hname_seed;
 
-static inline int is_not_crlf(int c) { return c != '\r' && c != '\n'; }
+// Seeds tried for the table before giving up, a handful are needed usually.
+#define HNAME_SEEDS_MAX (1 << 16)
+
+/// @brief Hashes all characters of a header name with FNV-1a, starting at
+///        seed. Letters are hashed ignoring case.
+static inline uint32_t hash_header_name(String name, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ seed;
+	for (int i = 0; i < name.len; ++i)
+		h = (h ^ (unsigned char)(name.data[i] | 0x20)) * 16777619u;
+	return h >> (32 - HNAME_TABLE_BITS);
+}
+
+/// @brief Finds a seed for which no two standard names share a slot.
+__attribute__((constructor)) static void build_hname_table(void)
+{
+	// Names sharing a slot for the last seed tried.
+	int first = 0, second = 0;
+
+	for (uint32_t seed = 0; seed < HNAME_SEEDS_MAX; ++seed) {
+		memset(hname_table, 0, sizeof hname_table);
+
+		int i = 0;
+		for (; i < HNAME_COUNT; ++i) {
+			uint8_t *slot =
+				&hname_table[hash_header_name(HEADER_NAME_STRINGS[i], seed)];
+			if (*slot != 0)
+				break;
+			*slot = i + 1;
+		}
+
+		if (i == HNAME_COUNT) {
+			hname_seed = seed;
+			return;
+		}
+		first = hname_table[hash_header_name(HEADER_NAME_STRINGS[i], seed)] - 1;
+		second = i;
+	}
+
+	LOG_FATAL(
+		"No perfect hash for standard header names, \"%.*s\" collides with "
+		"\"%.*s\"",
+		HEADER_NAME_STRINGS[first].len, HEADER_NAME_STRINGS[first].data,
+		HEADER_NAME_STRINGS[second].len, HEADER_NAME_STRINGS[second].data
+	);
+	abort();
+}
+
+/// @brief Looks up a standard header name ignoring case.
+/// @return HNAME_* value or -1 if not a standard header name.
+static inline int find_header_name(String name)
+{
+	if (name.len == 0)
+		return -1;
+
+	int i = hname_table[hash_header_name(name, hname_seed)] - 1;
+	if (i < 0 || !string_eq_case(name, HEADER_NAME_STRINGS[i]))
+		return -1;
+	return i;
+}
 
 static inline Token make_token(enum TokenType tt, Scanner *s)
 {
@@ -76,12 +279,6 @@ static void scanner_init(Scanner *s, const char *source, int len)
 	s->current = (Token){.ttype = TOK_ERROR};
 }
 
-static inline void scanner_ungetc(Scanner *s)
-{
-	if (s->at - s->source > 0)
-		s->at--;
-}
-
 static inline int scanner_getc(Scanner *s)
 {
 	if (s->at == s->end)
@@ -96,29 +293,22 @@ static inline int scanner_peekc(const Scanner *s)
 	return *s->at;
 }
 
-static inline void skip_while_impl(Scanner *s, int (*predicate)(int))
-{
-	int c = 0;
-	while ((c = scanner_getc(s)) != EOF && predicate(c))
-		/* nothing */;
-
-	scanner_ungetc(s); // Unconsume the unmatched char
-}
-
 static inline void scanner_skip_blanks(Scanner *s)
 {
-	skip_while_impl(s, isblank);
+	// Runs of blanks are short, usually a single space.
+	while (s->at < s->end && (*s->at == ' ' || *s->at == '\t'))
+		s->at++;
 }
 
 /// @brief Returns a token spanning from the current position upto
-///        where `predicate` is satisfied by the characters.
+///        where the characters belong to the class.
 /// @param s Scanner
-/// @param predicate Unary predicate
+/// @param cls Character class
 /// @return Token
-static inline Token scanner_skip_while(Scanner *s, int (*predicate)(int))
+static inline Token scanner_skip_while(Scanner *s, enum CharClass cls)
 {
 	s->start = s->at;
-	skip_while_impl(s, predicate);
+	s->at = span_class(s->at, s->end, cls);
 
 	s->current = make_token(TOK_CUSTOM, s);
 	return s->current;
@@ -140,12 +330,12 @@ static Token next_token_impl(Scanner *s)
 		scanner_getc(s); // consume '\n'
 		return make_token(TOK_CRLF, s);
 	}
-	if (isblank(c)) {
-		skip_while_impl(s, isblank);
+	if (c == ' ' || c == '\t') {
+		scanner_skip_blanks(s);
 		return make_token(TOK_BLANKS, s);
 	}
-	if (is_name_char(c)) {
-		skip_while_impl(s, is_name_char);
+	if (in_class(CLASS_NAME, c)) {
+		s->at = span_class(s->at, s->end, CLASS_NAME);
 		return make_token(TOK_NAME, s);
 	}
 
@@ -204,9 +394,14 @@ static bool decode_percent_encoding(String s, StringBuilder *res)
 	return true;
 }
 
+// Percent-decoded request paths, URIs without '%' are used in place.
+static _Thread_local char decoded_path[URI_SIZE_MAX];
+
 /// @brief Parse URI by decoding(the % encoding) and splitting it into parts.
-/// @param s Scanner
-/// @param r Request header with `r->uri.full` field filled.
+///        Only the path is decoded, into a per-thread buffer and only if
+///        it has percent encoded characters.
+/// @param r Request header, its `uri` field is filled.
+/// @param uri The request-URI as present in the request line.
 /// @return true if successful.
 static bool parse_uri_string(HTTPHeader *r, String uri)
 {
@@ -215,18 +410,26 @@ static bool parse_uri_string(HTTPHeader *r, String uri)
 
 	String path = uri, query = {0}, segment = {0};
 
-	int query_at = string_findc(uri, '?');
-	if (query_at >= 0)
-		string_partition(path, query_at, &path, &query);
-
-	int seg_at = string_findc(query, '#');
+	int seg_at = string_findc(path, '#');
 	if (seg_at >= 0)
 		string_partition(path, seg_at, &path, &segment);
 
-	r->uri.raw.len = uri.len;
-	memcpy(r->uri.raw.data, uri.data, uri.len);
+	int query_at = string_findc(path, '?');
+	if (query_at >= 0)
+		string_partition(path, query_at, &path, &query);
+
+	if (string_findc(path, '%') >= 0) {
+		// Decoded string is never longer than the encoded one.
+		StringBuilder decoded = STRING_BUILDER(decoded_path, URI_SIZE_MAX);
+		if (!decode_percent_encoding(path, &decoded))
+			return false;
+		path = STRING(decoded.data, decoded.len);
+	}
 
-	// TODO Decode percent encoding.
+	r->uri.full = uri;
+	r->uri.path = path;
+	r->uri.query = query;
+	r->uri.segment = segment;
 	return true;
 }
 
@@ -241,7 +444,7 @@ static bool parse_request_line(Scanner *s, HTTPHeader *r)
 
 	for (int i = 0; i < METHOD_UNKNOWN; ++i) {
 		String name = METHOD_NAME_STRINGS[i];
-		if (string_eq_case(name, name)) {
+		if (string_eq(name, s->current.lexeme)) {
 			r->method = i;
 			break;
 		}
@@ -249,13 +452,13 @@ static bool parse_request_line(Scanner *s, HTTPHeader *r)
 	SCANNER_CONSUME(s, TOK_BLANKS);
 
 	// Parse URI
-	Token uri = scanner_skip_while(s, is_uri_char);
+	Token uri = scanner_skip_while(s, CLASS_URI);
 	SCANNER_CONSUME(s, TOK_BLANKS);
 	if (!parse_uri_string(r, uri.lexeme))
 		return false;
 
 	// Parse HTTP version
-	Token ver = scanner_skip_while(s, is_not_crlf);
+	Token ver = scanner_skip_while(s, CLASS_NOT_CRLF);
 	if (string_eq_case(ver.lexeme, CSTRING("HTTP/1.0")))
 		r->version = 10;
 	else if (string_eq_case(ver.lexeme, CSTRING("HTTP/1.1")))
@@ -285,25 +488,18 @@ static bool parse_request_fields(Scanner *s, HTTPHeader *r)
 		SCANNER_CONSUME(s, TOK_COLON);
 		scanner_skip_blanks(s);
 
-		scanner_skip_while(s, is_not_crlf);
+		scanner_skip_while(s, CLASS_NOT_CRLF);
 		String value = s->current.lexeme;
 
 		SCANNER_CONSUME(s, TOK_CRLF);
 
 		// Check if it is a standard header name we know.
-		int std_header = -1;
-		for (int i = 0; i < HNAME_COUNT; ++i) {
-			if (!string_eq_case(header_name, HEADER_NAME_STRINGS[i]))
-				continue;
+		int std_header = find_header_name(header_name);
 
+		if (std_header != -1) {
 			// We do not allow repeating any std header names.
-			if (!string_is_null(r->std_fields[i]))
+			if (!string_is_null(r->std_fields[std_header]))
 				return false;
-			std_header = i;
-			break;
-		}
-
-		if (std_header != -1) {
 			r->std_fields[std_header] = value;
 		} else {
 			if (r->extra_field_cnt == EXTRA_FIELDS_MAX)
@@ -312,13 +508,212 @@ static bool parse_request_fields(Scanner *s, HTTPHeader *r)
 			HeaderField field = {.name = header_name, .value = value};
 			r->extra_fields[r->extra_field_cnt++] = field;
 		}
-
-		return true;
 	}
 }
 
 // static bool parse_request_data(Scanner *s, HTTPRequest *r) {}
 
+static String trim_blanks(String s)
+{
+	while (s.len > 0 && isblank(s.data[0]))
+		s.data++, s.len--;
+	while (s.len > 0 && isblank(s.data[s.len - 1]))
+		s.len--;
+	return s;
+}
+
+/// @brief Returns the next element of a comma separated list, starting at
+///        `*at` which is moved past it. Surrounding blanks are removed.
+/// @return Null string at the end of the list.
+static String next_list_element(String list, int *at)
+{
+	int i = *at;
+	while (i < list.len && (list.data[i] == ',' || isblank(list.data[i])))
+		i++;
+	if (i == list.len) {
+		*at = i;
+		return (String){0};
+	}
+
+	int start = i;
+	while (i < list.len && list.data[i] != ',')
+		i++;
+
+	*at = i;
+	return trim_blanks(STRING(list.data + start, i - start));
+}
+
+bool header_has_token(String value, String token)
+{
+	int at = 0;
+	String element;
+	while (!string_is_null(element = next_list_element(value, &at))) {
+		if (string_eq_case(element, token))
+			return true;
+	}
+
+	return false;
+}
+
+/// @brief Removes the "W/" prefix of a weak entity-tag.
+static String opaque_tag(String etag)
+{
+	if (etag.len >= 2 && etag.data[0] == 'W' && etag.data[1] == '/')
+		return STRING(etag.data + 2, etag.len - 2);
+	return etag;
+}
+
+bool header_has_etag(String value, String etag)
+{
+	String tag = opaque_tag(etag);
+	int at = 0;
+	String element;
+	while (!string_is_null(element = next_list_element(value, &at))) {
+		if (string_eq(element, CSTRING("*")) ||
+		    string_eq(opaque_tag(element), tag))
+			return true;
+	}
+
+	return false;
+}
+
+/// @brief Parses a qvalue: 0 or 1 with upto three decimals.
+/// @return Value in thousandths, -1 if invalid.
+static int parse_qvalue(String s)
+{
+	if (s.len == 0 || s.len > 5 || (s.data[0] != '0' && s.data[0] != '1'))
+		return -1;
+
+	int q = (s.data[0] - '0') * 1000;
+	if (s.len > 1 && s.data[1] != '.')
+		return -1;
+	for (int i = 2, scale = 100; i < s.len; ++i, scale /= 10) {
+		if (!isdigit(s.data[i]))
+			return -1;
+		q += (s.data[i] - '0') * scale;
+	}
+
+	return q <= 1000 ? q : -1;
+}
+
+/// @brief Parses a byte position, all of it must be digits.
+/// @return The position, -1 if invalid or too large.
+static off_t parse_position(String s)
+{
+	// Larger positions could overflow.
+	if (s.len == 0 || s.len > 18)
+		return -1;
+
+	off_t pos = 0;
+	for (int i = 0; i < s.len; ++i) {
+		if (!isdigit(s.data[i]))
+			return -1;
+		pos = pos * 10 + (s.data[i] - '0');
+	}
+	return pos;
+}
+
+int parse_range(String value, off_t size, ByteRange *ranges)
+{
+	String unit = {0};
+	String set = {0};
+	if (!string_partition(value, string_findc(value, '='), &unit, &set) ||
+	    !string_eq_case(trim_blanks(unit), CSTRING("bytes")))
+		return -1;
+
+	int cnt = 0;
+	bool is_empty = true;
+	int at = 0;
+	String spec;
+	while (!string_is_null(spec = next_list_element(set, &at))) {
+		is_empty = false;
+		String first_pos = {0};
+		String last_pos = {0};
+		if (!string_partition(spec, string_findc(spec, '-'), &first_pos, &last_pos))
+			return -1;
+
+		ByteRange r = {.last = size - 1};
+		if (first_pos.len == 0) {
+			// Suffix range: the last bytes of the representation.
+			off_t suffix_len = parse_position(last_pos);
+			if (suffix_len < 0)
+				return -1;
+			if (suffix_len == 0 || size == 0)
+				continue;
+			r.first = suffix_len < size ? size - suffix_len : 0;
+		} else {
+			r.first = parse_position(first_pos);
+			off_t last = last_pos.len > 0 ? parse_position(last_pos) : r.last;
+			if (r.first < 0 || last < 0 ||
+			    (last_pos.len > 0 && last < r.first))
+				return -1;
+			if (r.first >= size)
+				continue;
+			if (last < r.last)
+				r.last = last;
+		}
+
+		if (cnt == RANGES_MAX)
+			return -1;
+		ranges[cnt++] = r;
+	}
+
+	return is_empty ? -1 : cnt;
+}
+
+AcceptEncoding parse_accept_encoding(String value)
+{
+	AcceptEncoding accept = {.q = {[CODING_IDENTITY] = 1000}};
+	bool is_listed[CODING_COUNT] = {false};
+	// Quality of codings not listed, if "*" is.
+	int others_q = -1;
+
+	int at = 0;
+	String element;
+	while (!string_is_null(element = next_list_element(value, &at))) {
+		// An element is: coding *(OWS ";" OWS parameter)
+		String coding = element;
+		String params = {0};
+		int semi = string_findc(element, ';');
+		string_partition(element, semi, &coding, &params);
+		coding = trim_blanks(coding);
+
+		int q = 1000;
+		while (params.len > 0) {
+			String param = params;
+			semi = string_findc(params, ';');
+			if (!string_partition(params, semi, &param, &params))
+				params.len = 0;
+			param = trim_blanks(param);
+			if (param.len >= 2 && tolower(param.data[0]) == 'q' &&
+			    param.data[1] == '=')
+				q = parse_qvalue(STRING(param.data + 2, param.len - 2));
+		}
+		if (q < 0)
+			continue;
+
+		if (string_eq(coding, CSTRING("*")))
+			others_q = q;
+		// An old name of gzip, still sent by some clients.
+		if (string_eq_case(coding, CSTRING("x-gzip")))
+			coding = CONTENT_CODING_STRINGS[CODING_GZIP];
+		for (int c = 0; c < CODING_COUNT; ++c) {
+			if (string_eq_case(coding, CONTENT_CODING_STRINGS[c])) {
+				accept.q[c] = q;
+				is_listed[c] = true;
+			}
+		}
+	}
+
+	if (others_q >= 0) {
+		for (int c = 0; c < CODING_COUNT; ++c) {
+			if (!is_listed[c])
+				accept.q[c] = others_q;
+		}
+	}
+	return accept;
+}
+
 bool parse_request(HTTPHeader *r)
 {
 	// Make all field values null strings, because that's how we check if a
@@ -330,13 +725,10 @@ bool parse_request(HTTPHeader *r)
 	scanner_init(&s, r->raw.data, r->raw.len);
 
 	// Grab the first line first.
-	for (int i = 0; i < r->raw.len; ++i) {
-		char c = r->raw.data[i];
-		if (c != '\n' && c != '\r')
-			continue;
-		r->first_line = STRING(r->raw.data, i);
-		break;
-	}
+	const char *end = r->raw.data + r->raw.len;
+	const char *eol = span_class(r->raw.data, end, CLASS_NOT_CRLF);
+	if (eol != end)
+		r->first_line = STRING(r->raw.data, eol - r->raw.data);
 
 	if (!parse_request_line(&s, r))
 		return false;
@@ -5,8 +5,39 @@
 #include "request.h"
 
 /// @brief Parse the request and put all data in request.
+///        The header data is parsed in place, all fields point into it.
 /// @param r
 /// @return true on success
 bool parse_request(HTTPHeader *request);
 
+/// @brief Checks if a comma separated header-field value contains a token.
+/// @param value Header-field value, like: "keep-alive, Upgrade"
+/// @param token Token to look for, it is compared ignoring case.
+/// @return true if found
+bool header_has_token(String value, String token);
+
+/// @brief Checks if an If-None-Match field value matches an entity-tag, using
+///        weak comparison: the tags are the same ignoring the "W/" prefix.
+/// @param value Field value, like: "*" or: W/"5f2a-1c8", "a-b-c"
+/// @param etag Entity-tag of the current representation.
+/// @return true if "*" or any of the listed tags matches.
+bool header_has_etag(String value, String etag);
+
+/// @brief Parses the value of a Range field for a representation.
+/// @param value Field value, like: "bytes=0-499, 1000-, -500"
+/// @param size Length of the representation.
+/// @param ranges Filled with the satisfiable ranges, at most RANGES_MAX of
+///        them, with last positions beyond the end cut to it.
+/// @return Number of satisfiable ranges. -1 if the field is invalid, uses
+///         a unit other than bytes or has too many ranges, then it must be
+///         ignored.
+int parse_range(String value, off_t size, ByteRange *ranges);
+
+/// @brief Parses the value of an Accept-Encoding field.
+/// @param value Field value, like: "br;q=1.0, gzip;q=0.8, *;q=0.1". It is a
+///        null string if the field is absent, then only identity is
+///        acceptable.
+/// @return Qualities of the codings we know.
+AcceptEncoding parse_accept_encoding(String value);
+
 #endif
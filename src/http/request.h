@@ -1,28 +1,33 @@
 #ifndef REQUEST_H_INCLUDED
 #define REQUEST_H_INCLUDED
 
+#include <string.h>
+
 #include "common.h"
 #include "http/http.h"
 
-/// @brief Checks if header has CRLF CRLF at end. Even an LF is treated as a CRLF.
-/// @param r HTTPHeader object
-/// @return boolean
-static inline bool is_request_header_end(HTTPHeader *r)
+/// @brief Finds the empty line which ends a request header. Even an LF is
+///        treated as a CRLF. Lines are found using memchr, which is vectorized.
+/// @param data Data received over the connection.
+/// @param len Length of data
+/// @param from Index to start searching from, bytes before it were already
+///        searched. The search starts two bytes earlier than it to find an end
+///        spanning both old and new bytes.
+/// @return Length of the header including the empty line, 0 if not found.
+static inline int find_header_end(const char *data, int len, int from)
 {
-	int len = r->raw.len >= 4 ? 4 : r->raw.len;
-	const char *end = r->raw.data + r->raw.len;
-	const char *start = end - len;
-	int prev = 0;
+	const char *end = data + len;
+	const char *at = data + (from > 2 ? from - 2 : 0);
 
-	for (; start != end; ++start) {
-		if (*start == '\n' && prev == '\n')
-			return true;
-		if (*start == '\r')
-			continue;
-		prev = *start;
+	while (at < end && (at = memchr(at, '\n', end - at)) != NULL) {
+		at++;
+		if (at < end && *at == '\r')
+			at++;
+		if (at < end && *at == '\n')
+			return at + 1 - data;
 	}
 
-	return false;
+	return 0;
 }
 
 #endif
@@ -1,28 +1,95 @@
+#include <assert.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 
 #include "common.h"
 #include "config.h"
 #include "logger.h"
+#include "stats.h"
+#include "trace.h"
 #include "coroless.h"
 #include "io/bufio.h"
 
-void writer_put_data(BufWriter *b, const char *data, int len)
+static void put_segment(BufWriter *b, WriterSegment seg, const char *caller)
 {
 	if (b->is_closed) {
-		LOG_FATAL("%s: Cannot put data in a closed stream.", __func__);
+		LOG_FATAL("%s: Cannot put data in a closed stream.", caller);
 		abort();
 	}
-	if (b->data != NULL) {
-		LOG_FATAL(
-			"%s: Cannot put in new data without draining the old data.",
-			__func__
-		);
+	if (b->seg_cnt == WRITER_SEGMENTS_MAX) {
+		LOG_FATAL("%s: Cannot put in more data without draining.", caller);
 		abort();
 	}
+	if (seg.len == 0)
+		return;
+
+	b->segs[b->seg_cnt++] = seg;
+	b->len += seg.len;
+}
 
-	b->data = data;
-	b->len = len;
+void writer_put_data(BufWriter *b, const char *data, int len)
+{
+	WriterSegment seg = {.file_fd = -1, .data = data, .len = len};
+	put_segment(b, seg, __func__);
+}
+
+void writer_put_iov(BufWriter *b, const struct iovec *iov, int cnt)
+{
+	for (int i = 0; i < cnt; ++i) {
+		WriterSegment seg = {
+			.file_fd = -1,
+			.data = iov[i].iov_base,
+			.len = iov[i].iov_len,
+		};
+		put_segment(b, seg, __func__);
+	}
+}
+
+void writer_put_file(BufWriter *b, int fd, off_t offset, size_t len)
+{
+	WriterSegment seg = {.file_fd = fd, .file_offset = offset, .len = len};
+	put_segment(b, seg, __func__);
+}
+
+/// @brief Skips over `len` bytes of written pending data.
+static void advance_segments(BufWriter *b, size_t len)
+{
+	b->len -= len;
+
+	while (len > 0) {
+		WriterSegment *seg = &b->segs[b->seg_at];
+		size_t done = len < seg->len ? len : seg->len;
+
+		// sendfile advances the file offset by itself.
+		if (seg->file_fd < 0)
+			seg->data += done;
+		seg->len -= done;
+		len -= done;
+
+		if (seg->len == 0)
+			b->seg_at++;
+	}
+}
+
+/// @brief Writes consecutive memory segments from seg_at with one call.
+static ssize_t send_memory_segments(BufWriter *b)
+{
+	struct iovec iov[WRITER_SEGMENTS_MAX];
+	int cnt = 0;
+	int flags = MSG_NOSIGNAL;
+
+	for (int i = b->seg_at; i < b->seg_cnt; ++i) {
+		const WriterSegment *seg = &b->segs[i];
+		if (seg->file_fd >= 0) {
+			flags |= MSG_MORE;
+			break;
+		}
+		iov[cnt++] = (struct iovec){(char *)seg->data, seg->len};
+	}
+
+	struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+	return sendmsg(b->sock_fd, &msg, flags);
 }
 
 int async_writer_drain(BufWriter *b)
@@ -32,48 +99,78 @@ int async_writer_drain(BufWriter *b)
 		abort();
 	}
 
-	while (b->len > 0) {
-		int len = send(b->sock_fd, b->data, b->len, MSG_NOSIGNAL);
+	while (b->seg_at < b->seg_cnt) {
+		WriterSegment *seg = &b->segs[b->seg_at];
+		bool is_file = seg->file_fd >= 0;
+
+		ssize_t len = 0;
+		if (is_file)
+			len = sendfile(b->sock_fd, seg->file_fd, &seg->file_offset, seg->len);
+		else
+			len = send_memory_segments(b);
+
 		if (len < 0) {
-			if (is_blocking_error(errno))
+			if (is_blocking_error(errno)) {
+				stats_add(STAT_WRITE_BLOCKED, 1);
 				return CORO_PENDING;
+			}
 			if (errno == EPIPE || errno == ECONNRESET) {
 				b->is_closed = true;
 				return CORO_IO_CLOSED;
 			}
-			ERRNO_FATAL("send");
+			ERRNO_FATAL(is_file ? "sendfile" : "sendmsg");
+		}
+		// File was truncated after we got its size, we cannot send the rest.
+		if (len == 0 && is_file) {
+			b->is_closed = true;
+			return CORO_IO_CLOSED;
 		}
 
-		b->data += len;
-		b->len -= len;
+		stats_add(STAT_BYTES_SENT, len);
+		bool is_first_seg = b->seg_at == 0;
+		advance_segments(b, len);
+		if (is_first_seg && b->seg_at > 0)
+			TRACE_PHASE(TRACE_HEADER_WRITTEN);
 	}
 
 	assert(b->len == 0);
-	b->data = NULL;
+	b->seg_at = b->seg_cnt = 0;
+	TRACE_PHASE(TRACE_DRAINED);
 
 	return CORO_DONE;
 }
 
-/// @brief Clears the buffer and reads in new data
-/// @param b
-/// @return Amount of data read, or a negative value from IOResult if error.
-int async_read_to_buffer(BufReader *b)
+int async_reader_read(BufReader *b, char *buffer, int size)
 {
-	b->at = 0;
-	b->count = 0;
-
-	int len = recv(b->sock_fd, b->data, BUFFER_SIZE, 0);
-	if (len == 0) {
-		b->is_eof = true;
+	assert(size > 0);
+	if (b->is_eof)
 		return CORO_IO_EOF;
+
+	int len = 0;
+	if (b->receive != NULL) {
+		len = b->receive(b->receive_ctx, buffer, size);
+		if (len == CORO_PENDING)
+			return CORO_PENDING;
+		if (len == CORO_IO_EOF)
+			len = 0;
+	} else {
+		len = recv(b->sock_fd, buffer, size, 0);
 	}
+
 	if (len < 0) {
-		if (is_blocking_error(errno))
+		if (is_blocking_error(errno)) {
+			stats_add(STAT_READ_BLOCKED, 1);
 			return CORO_PENDING;
-		ERRNO_FATAL("recv");
+		}
+		if (errno != ECONNRESET)
+			ERRNO_FATAL("recv");
+		len = 0; // Nothing more can be read after a reset.
+	}
+	if (len == 0) {
+		b->is_eof = true;
+		return CORO_IO_EOF;
 	}
 
 	b->read_cnt += len;
-	b->count = len;
 	return len;
 }
@@ -1,60 +1,98 @@
 #ifndef BUFIO_H_INCLUDED
 #define BUFIO_H_INCLUDED
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include "common.h"
+#include "config.h"
 #include "logger.h"
 #include "coroless.h"
 
+/// @brief Takes data received for a connection by someone else, like the
+///        event loop, instead of the reader reading the socket itself.
+/// @return Number of bytes copied into buffer, or CORO_PENDING or CORO_IO_EOF.
+typedef int (*ReceiveFn)(void *ctx, char *buffer, int size);
+
+/// @brief Reads data from a connection directly into the caller's buffer.
 typedef struct BufReader {
 	int sock_fd;
-	int count;
-	int at;
 	// Total bytes of data read from the sock_fd(socket)
 	int read_cnt;
 	bool is_eof;
-	char data[BUFFER_SIZE];
+	// If set, data is taken using it instead of reading sock_fd.
+	ReceiveFn receive;
+	void *receive_ctx;
 } BufReader;
 
+/// @brief A piece of data queued in a BufWriter: memory or a range of a file.
+typedef struct WriterSegment {
+	// File to send data from, -1 if data is in memory.
+	int file_fd;
+	off_t file_offset;
+	const char *data;
+	size_t len;
+} WriterSegment;
+
+/// @brief Queue of data segments to be written to a connection. Consecutive
+///        memory segments are written using a single sendmsg call and
+///        file segments using sendfile.
 typedef struct BufWriter {
 	int sock_fd;
-	int len;
 	bool is_closed;
-	const char *data;
+	// Total length of pending data.
+	size_t len;
+	// Pending segments, seg_at is the first one not completely written.
+	WriterSegment segs[WRITER_SEGMENTS_MAX];
+	int seg_at;
+	int seg_cnt;
 } BufWriter;
 
-/// @brief Puts data into the writer for writing to a connection.
-///        No data is written to the socket, use `async_writer_drain` for that.
-///        Attempt to put new data without draining all the old data is an error.
+/// @brief Puts data into the writer for writing to a connection, after any
+///        data already put into it. No data is written to the socket, use
+///        `async_writer_drain` for that. Putting more than WRITER_SEGMENTS_MAX
+///        segments without draining is an error, see `writer_space`.
 /// @param b BufWriter
 /// @param data Data to be written. It must not change until all data has been
 ///        written to the socket using `async_writer_drain`.
 /// @param len Length of the data
 void writer_put_data(BufWriter *b, const char *data, int len);
 
-/// @brief Writes the data to the socket as much as it can.
+/// @brief Puts multiple pieces of data into the writer, same as calling
+///        `writer_put_data` for each one of them.
 /// @param b BufWriter
-/// @return Returns IoResult indicating status.
-int async_writer_drain(BufWriter *b);
+/// @param iov Data pieces, they are copied into the writer.
+/// @param cnt Number of pieces
+void writer_put_iov(BufWriter *b, const struct iovec *iov, int cnt);
 
-/// @brief Reads a byte from the socket
-/// @param b
-/// @return
-static inline int async_reader_getc(BufReader *b)
-{
-	int async_read_to_buffer(BufReader * b);
+/// @brief Puts a range of a file into the writer for writing to a connection.
+///        Data is sent using sendfile, so it never passes through user space.
+///        Same rules as for `writer_put_data` apply.
+/// @param b BufWriter
+/// @param fd File to send data from, it must stay open until all data has
+///        been written to the socket using `async_writer_drain`.
+/// @param offset Offset of the range in the file.
+/// @param len Length of the range
+void writer_put_file(BufWriter *b, int fd, off_t offset, size_t len);
 
-	if (b->at == b->count) {
-		if (b->is_eof)
-			return CORO_IO_EOF;
+/// @brief Returns the number of segments which can be put without draining.
+static inline int writer_space(const BufWriter *b)
+{
+	return WRITER_SEGMENTS_MAX - b->seg_cnt;
+}
 
-		int res = async_read_to_buffer(b);
-		if (res == CORO_SYS_ERROR)
-			ERRNO_FATAL("async_read_to_buffer");
-		if (res < 0)
-			return res;
-	}
+/// @brief Writes the queued data to the socket in order, as much as it can.
+///        Memory data followed by a file is sent with MSG_MORE, so that a
+///        header goes out in the same packet as the start of the body.
+/// @param b BufWriter
+/// @return Returns IoResult indicating status.
+int async_writer_drain(BufWriter *b);
 
-	return b->data[b->at++];
-}
+/// @brief Reads as much data as available from the socket, upto `size`.
+/// @param b BufReader
+/// @param buffer Data is read into it.
+/// @param size Size of buffer, it must not be zero.
+/// @return Number of bytes read, or CORO_PENDING or CORO_IO_EOF.
+int async_reader_read(BufReader *b, char *buffer, int size);
 
 #endif
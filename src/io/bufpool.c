@@ -0,0 +1,77 @@
+/**
+ * @file bufpool.c
+ * @brief Per-thread pool of buffers in power of 2 size classes.
+ *
+ * Connections borrow buffers only while they are serving a request, free
+ * buffers are kept in a list per size class for reuse by other connections
+ * of the same event loop. Buffers beyond BUFFER_POOL_FREE_MAX in a class are
+ * freed, so that a burst of activity does not pin its peak memory.
+ */
+
+#include "common.h"
+#include "config.h"
+#include "logger.h"
+#include "memory.h"
+#include "io/bufpool.h"
+
+typedef struct FreeBuffer {
+	struct FreeBuffer *next;
+} FreeBuffer;
+
+typedef struct BufferPool {
+	FreeBuffer *free[BUFFER_CLASSES];
+	int free_cnt[BUFFER_CLASSES];
+} BufferPool;
+
+static _Thread_local BufferPool pool;
+// Size of the smallest class, shared by the pools of all threads.
+static size_t smallest_size = BUFFER_SIZE;
+
+void bufpool_set_size(size_t size)
+{
+	smallest_size = size;
+}
+
+/// @brief Returns the smallest size class fitting `size`, or -1 if too large.
+static int size_class(size_t size)
+{
+	size_t class_size = smallest_size;
+	for (int i = 0; i < BUFFER_CLASSES; ++i, class_size *= 2) {
+		if (size <= class_size)
+			return i;
+	}
+	return -1;
+}
+
+void *bufpool_get(size_t size)
+{
+	int cls = size_class(size);
+	if (cls >= 0 && pool.free[cls] != NULL) {
+		FreeBuffer *b = pool.free[cls];
+		pool.free[cls] = b->next;
+		pool.free_cnt[cls]--;
+		return b;
+	}
+
+	void *buffer = ALLOCATE_SIZED(cls >= 0 ? smallest_size << cls : size);
+	if (buffer == NULL)
+		ERRNO_FATAL("calloc");
+	return buffer;
+}
+
+void bufpool_put(void *buffer, size_t size)
+{
+	if (buffer == NULL)
+		return;
+
+	int cls = size_class(size);
+	if (cls < 0 || pool.free_cnt[cls] == BUFFER_POOL_FREE_MAX) {
+		FREE(buffer);
+		return;
+	}
+
+	FreeBuffer *b = buffer;
+	b->next = pool.free[cls];
+	pool.free[cls] = b;
+	pool.free_cnt[cls]++;
+}
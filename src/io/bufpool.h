@@ -0,0 +1,22 @@
+#ifndef BUFPOOL_H_INCLUDED
+#define BUFPOOL_H_INCLUDED
+
+#include <stddef.h>
+
+/// @brief Sets the size of the smallest size class, BUFFER_SIZE by default.
+///        It must be called before any thread takes a buffer.
+/// @param size Size in bytes, at least that of a pointer.
+void bufpool_set_size(size_t size);
+
+/// @brief Takes a buffer of at least `size` bytes from the pool of the
+///        calling thread. Its contents are unspecified.
+/// @param size
+/// @return Pointer to the buffer, never NULL.
+void *bufpool_get(size_t size);
+
+/// @brief Gives a buffer back to the pool of the calling thread.
+/// @param buffer Buffer from bufpool_get, it can be NULL.
+/// @param size The size it was taken with.
+void bufpool_put(void *buffer, size_t size);
+
+#endif
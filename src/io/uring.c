@@ -0,0 +1,197 @@
+/**
+ * @file uring.c
+ * @brief Setting up and driving an io_uring instance without liburing.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "logger.h"
+#include "memory.h"
+#include "io/uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(
+	int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+	void *arg, size_t arg_size
+)
+{
+	return syscall(
+		__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size
+	);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool uring_init(Uring *u, unsigned entries)
+{
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_CQSIZE,
+		.cq_entries = entries * 4,
+	};
+
+	int fd = sys_io_uring_setup(entries, &p);
+	if (fd < 0)
+		return false;
+
+	// Waiting with a timeout needs EXT_ARG, and both rings in one mapping
+	// keeps it simple. Both are there since Linux 5.11.
+	if (!(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(fd);
+		errno = ENOSYS;
+		return false;
+	}
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+	char *ring = mmap(
+		NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+		IORING_OFF_SQ_RING
+	);
+	if (ring == MAP_FAILED)
+		ERRNO_FATAL("mmap io_uring");
+
+	size_t sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	struct io_uring_sqe *sqes = mmap(
+		NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+		IORING_OFF_SQES
+	);
+	if (sqes == MAP_FAILED)
+		ERRNO_FATAL("mmap io_uring");
+
+	*u = (Uring){
+		.fd = fd,
+		.sq_head = (unsigned *)(ring + p.sq_off.head),
+		.sq_tail = (unsigned *)(ring + p.sq_off.tail),
+		.sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask),
+		.sq_entries = p.sq_entries,
+		.sqes = sqes,
+		.cq_head = (unsigned *)(ring + p.cq_off.head),
+		.cq_tail = (unsigned *)(ring + p.cq_off.tail),
+		.cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask),
+		.cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes),
+	};
+	u->sq_local_tail = *u->sq_tail;
+
+	// SQEs are always used in order, so the index array maps them 1:1.
+	unsigned *array = (unsigned *)(ring + p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; ++i)
+		array[i] = i;
+
+	return true;
+}
+
+/// @brief Makes queued SQEs visible to the kernel and submits them.
+static int submit(Uring *u, unsigned wait_nr, unsigned flags, void *arg, size_t size)
+{
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+	unsigned pending =
+		u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+	if (wait_nr > 0)
+		flags |= IORING_ENTER_GETEVENTS;
+	return sys_io_uring_enter(u->fd, pending, wait_nr, flags, arg, size);
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *u)
+{
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (u->sq_local_tail - head == u->sq_entries) {
+		if (submit(u, 0, 0, NULL, 0) < 0 && errno != EBUSY && errno != EINTR)
+			ERRNO_FATAL("io_uring_enter");
+		head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		if (u->sq_local_tail - head == u->sq_entries) {
+			LOG_FATAL("io_uring submission queue is stuck");
+			abort();
+		}
+	}
+
+	struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail++ & u->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	return sqe;
+}
+
+int uring_enter(Uring *u, int timeout_ms)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = timeout_ms % 1000 * 1000000L,
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts = timeout_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0,
+	};
+
+	int ret = submit(u, 1, IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+	if (ret < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY))
+		return 0;
+	return ret;
+}
+
+bool uring_setup_buf_ring(
+	Uring *u, UringBufRing *br, uint16_t group, int count, int size
+)
+{
+	assert(count > 0 && (count & (count - 1)) == 0 && count <= 32768);
+
+	size_t ring_size = count * sizeof(struct io_uring_buf);
+	void *ring = mmap(
+		NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0
+	);
+	if (ring == MAP_FAILED)
+		ERRNO_FATAL("mmap");
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uint64_t)(uintptr_t)ring,
+		.ring_entries = count,
+		.bgid = group,
+	};
+	if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		munmap(ring, ring_size);
+		return false;
+	}
+
+	char *buffers = ALLOCATE_SIZED_ARRAY(size, count);
+	if (buffers == NULL)
+		ERRNO_FATAL("calloc");
+
+	*br = (UringBufRing){
+		.ring = ring,
+		.buffers = buffers,
+		.group = group,
+		.mask = count - 1,
+		.count = count,
+		.buffer_size = size,
+	};
+	for (int i = 0; i < count; ++i)
+		uring_recycle_buffer(br, i);
+
+	return true;
+}
+
+void uring_recycle_buffer(UringBufRing *br, uint16_t bid)
+{
+	struct io_uring_buf *buf = &br->ring->bufs[br->tail & br->mask];
+	buf->addr = (uint64_t)(uintptr_t)uring_buffer(br, bid);
+	buf->len = br->buffer_size;
+	buf->bid = bid;
+
+	br->tail++;
+	__atomic_store_n(&br->ring->tail, br->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,94 @@
+#ifndef URING_H_INCLUDED
+#define URING_H_INCLUDED
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#include "common.h"
+
+/// @brief Minimal io_uring instance, used through raw system calls.
+///        Used by a single thread only.
+typedef struct Uring {
+	int fd;
+
+	// Submission queue, `sq_local_tail` counts SQEs handed out but not yet
+	// made visible to the kernel.
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local_tail;
+	struct io_uring_sqe *sqes;
+
+	// Completion queue
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+} Uring;
+
+/// @brief Ring of buffers which the kernel picks from for receives,
+///        a provided buffer ring.
+typedef struct UringBufRing {
+	struct io_uring_buf_ring *ring;
+	char *buffers;
+	uint16_t group;
+	uint16_t mask;
+	uint16_t tail;
+	int count;
+	int buffer_size;
+} UringBufRing;
+
+/// @brief Sets up an io_uring instance.
+/// @param u Uring
+/// @param entries Size of the submission queue, the completion queue is
+///        four times as large.
+/// @return false if io_uring is not available, errno tells why.
+bool uring_init(Uring *u, unsigned entries);
+
+/// @brief Returns a zeroed SQE to fill, it is submitted with the next
+///        `uring_enter`. If the queue is full, queued SQEs are submitted first.
+struct io_uring_sqe *uring_get_sqe(Uring *u);
+
+/// @brief Submits all queued SQEs and waits for a completion.
+/// @param u Uring
+/// @param timeout_ms Max time to wait for a completion, -1 waits without
+///        a limit.
+/// @return -1 on error, timeout and interruption are not errors.
+int uring_enter(Uring *u, int timeout_ms);
+
+/// @brief Returns the next completion or NULL if there is none, it must be
+///        consumed using `uring_cqe_seen` before getting the next one.
+static inline struct io_uring_cqe *uring_peek_cqe(Uring *u)
+{
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	return head == tail ? NULL : &u->cqes[head & u->cq_mask];
+}
+
+static inline void uring_cqe_seen(Uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/// @brief Registers a provided buffer ring with all of its buffers.
+/// @param u Uring
+/// @param br Buffer ring to set up
+/// @param group Buffer group ID used by SQEs selecting from it.
+/// @param count Number of buffers, must be a power of 2.
+/// @param size Size of each buffer.
+/// @return false if not supported, errno tells why.
+bool uring_setup_buf_ring(
+	Uring *u, UringBufRing *br, uint16_t group, int count, int size
+);
+
+/// @brief Returns the buffer with the given ID.
+static inline char *uring_buffer(const UringBufRing *br, uint16_t bid)
+{
+	return br->buffers + (size_t)bid * br->buffer_size;
+}
+
+/// @brief Gives a buffer back to the kernel, for it to receive into.
+void uring_recycle_buffer(UringBufRing *br, uint16_t bid);
+
+#endif
@@ -0,0 +1,254 @@
+/**
+ * @file logger.c
+ * @brief Log records batched through per-thread rings and a writer thread.
+ *
+ * Every thread which logs gets a single-producer single-consumer ring of
+ * bytes, records are appended to it whole. The writer thread wakes up every
+ * LOG_FLUSH_INTERVAL milliseconds and writes out everything in all rings,
+ * using one writev per ring. A record that does not fit in the free space
+ * of its ring is dropped and counted, the producer never waits for the
+ * writer. Dropped counts are reported by the writer as a log line. The
+ * rings are also flushed at exit and before fatal errors are printed.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "config.h"
+#include "logger.h"
+#include "memory.h"
+
+typedef struct LogRing {
+	// Positions only increase, they are wrapped when indexing the data.
+	// Producer owns head and consumer owns tail.
+	_Atomic size_t head;
+	_Atomic size_t tail;
+	_Atomic unsigned long dropped;
+	char data[LOG_RING_SIZE];
+} LogRing;
+
+typedef struct LogWriter {
+	int fd;
+	pthread_mutex_t lock;
+	LogRing *rings[LOG_THREADS_MAX];
+	_Atomic int ring_cnt;
+} LogWriter;
+
+static LogWriter writer = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+// Set once the writer thread is running.
+static _Atomic bool is_started = false;
+
+// Ring of the calling thread, NULL until it logs the first time.
+static _Thread_local LogRing *thread_ring = NULL;
+// Set if the thread could not get a ring.
+static _Thread_local bool has_no_ring = false;
+
+/// @brief Writes all of the data, retrying on partial writes.
+static void write_all(int fd, struct iovec *iov, int cnt)
+{
+	while (cnt > 0) {
+		ssize_t len = writev(fd, iov, cnt);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return; // Nowhere left to report it.
+		}
+
+		while (cnt > 0 && (size_t)len >= iov->iov_len) {
+			len -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+}
+
+static LogRing *get_thread_ring(void)
+{
+	if (thread_ring != NULL || has_no_ring)
+		return thread_ring;
+
+	pthread_mutex_lock(&writer.lock);
+	int cnt = atomic_load_explicit(&writer.ring_cnt, memory_order_relaxed);
+	if (cnt < LOG_THREADS_MAX) {
+		thread_ring = ALLOCATE(LogRing);
+		if (thread_ring == NULL) {
+			// Fatal errors flush the rings, which takes the lock.
+			pthread_mutex_unlock(&writer.lock);
+			ERRNO_FATAL("calloc");
+		}
+		writer.rings[cnt] = thread_ring;
+		atomic_store_explicit(&writer.ring_cnt, cnt + 1, memory_order_release);
+	}
+	pthread_mutex_unlock(&writer.lock);
+
+	has_no_ring = thread_ring == NULL;
+	return thread_ring;
+}
+
+/// @brief Appends a record to the ring, or drops it if there is no space.
+static void ring_push(LogRing *r, const char *data, size_t len)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	if (LOG_RING_SIZE - (head - tail) < len) {
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	size_t at = head & (LOG_RING_SIZE - 1);
+	size_t first = LOG_RING_SIZE - at < len ? LOG_RING_SIZE - at : len;
+	memcpy(r->data + at, data, first);
+	memcpy(r->data, data + first, len - first);
+
+	atomic_store_explicit(&r->head, head + len, memory_order_release);
+}
+
+/// @brief Writes out everything in the ring.
+static void ring_flush(LogRing *r, int fd)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (head == tail)
+		return;
+
+	size_t at = tail & (LOG_RING_SIZE - 1);
+	size_t len = head - tail;
+	size_t first = LOG_RING_SIZE - at < len ? LOG_RING_SIZE - at : len;
+
+	struct iovec iov[2] = {
+		{r->data + at, first},
+		{r->data, len - first},
+	};
+	write_all(fd, iov, len > first ? 2 : 1);
+
+	atomic_store_explicit(&r->tail, head, memory_order_release);
+}
+
+/// @brief Writes out all rings and reports dropped records, the caller
+///        must hold writer.lock so that each ring has a single consumer.
+static void flush_rings(void)
+{
+	int cnt = atomic_load_explicit(&writer.ring_cnt, memory_order_acquire);
+	unsigned long dropped = 0;
+	for (int i = 0; i < cnt; ++i) {
+		ring_flush(writer.rings[i], writer.fd);
+		dropped += atomic_exchange_explicit(
+			&writer.rings[i]->dropped, 0, memory_order_relaxed
+		);
+	}
+
+	if (dropped > 0) {
+		char line[64];
+		int len = snprintf(
+			line, sizeof line, "[WARN] Dropped %lu log record(s)\n", dropped
+		);
+		struct iovec iov = {line, len};
+		write_all(writer.fd, &iov, 1);
+	}
+}
+
+static void *writer_main(void *arg)
+{
+	(void)arg;
+	struct timespec interval = {
+		.tv_sec = LOG_FLUSH_INTERVAL / 1000,
+		.tv_nsec = LOG_FLUSH_INTERVAL % 1000 * 1000000L,
+	};
+
+	while (1) {
+		nanosleep(&interval, NULL);
+
+		pthread_mutex_lock(&writer.lock);
+		flush_rings();
+		pthread_mutex_unlock(&writer.lock);
+	}
+
+	return NULL;
+}
+
+void log_flush(void)
+{
+	if (!atomic_load_explicit(&is_started, memory_order_acquire))
+		return;
+
+	int saved_errno = errno;
+	pthread_mutex_lock(&writer.lock);
+	flush_rings();
+	pthread_mutex_unlock(&writer.lock);
+	errno = saved_errno;
+}
+
+bool log_start(const char *path)
+{
+	assert(!is_started);
+
+	writer.fd = STDERR_FILENO;
+	if (path != NULL) {
+		writer.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (writer.fd < 0)
+			return false;
+	}
+
+	// The writer takes no signals, its mask is inherited from ours.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t thread;
+	int err = pthread_create(&thread, NULL, writer_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		errno = err;
+		ERRNO_FATAL("pthread_create");
+	}
+	pthread_detach(thread);
+
+	atomic_store_explicit(&is_started, true, memory_order_release);
+	atexit(log_flush);
+	return true;
+}
+
+void log_record(const char *tag, const char *func, int line, const char *fmt, ...)
+{
+	char record[LOG_RECORD_MAX];
+	int len = 0;
+
+	if (func != NULL)
+		len = snprintf(record, sizeof record, "%s:%d ", func, line);
+	if (tag != NULL)
+		len += snprintf(record + len, sizeof record - len, "%s", tag);
+
+	va_list args;
+	va_start(args, fmt);
+	len += vsnprintf(record + len, sizeof record - len, fmt, args);
+	va_end(args);
+
+	// Truncated records still end with a newline.
+	if (len > LOG_RECORD_MAX - 1)
+		len = LOG_RECORD_MAX - 1;
+	record[len++] = '\n';
+
+	bool started = atomic_load_explicit(&is_started, memory_order_acquire);
+	LogRing *r = started ? get_thread_ring() : NULL;
+
+	if (r != NULL) {
+		ring_push(r, record, len);
+	} else {
+		struct iovec iov = {record, len};
+		write_all(started ? writer.fd : STDERR_FILENO, &iov, 1);
+	}
+}
@@ -2,6 +2,7 @@
 #define LOGGER_H_INCLUDED
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,21 +17,48 @@
 
 #define PRINTE(...) fprintf(stderr, __VA_ARGS__)
 
-#define LOG_DEBUG(...)                                                  \
-	(PRINTE("%s:%d [DEBUG] ", __func__, __LINE__), PRINTE(__VA_ARGS__), \
-	 PRINTE("\n"))
+/// @brief Formats a log record as a single line and logs it, see log_start.
+/// @param tag Prefix of the line, like "[INFO] ", it can be NULL.
+/// @param func Function logging it, it can be NULL.
+/// @param line Line number in func.
+void log_record(const char *tag, const char *func, int line, const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
 
-#define LOG_INFO(...) (PRINTE("[INFO] "), PRINTE(__VA_ARGS__), PRINTE("\n"))
+/// @brief Starts the background writer of log records. Afterwards, each
+///        thread appends its records to its own ring buffer which the writer
+///        flushes in batches, so that logging never blocks an event loop.
+///        If a ring is full, records are dropped and counted, the writer
+///        then logs how many were lost. Before it is called, records are
+///        written to stderr directly.
+/// @param path File to append logs to, stderr if NULL.
+/// @return false if the file cannot be opened.
+bool log_start(const char *path);
 
-#define LOG_WARN(...) (PRINTE("[WARN] "), PRINTE(__VA_ARGS__), PRINTE("\n"))
+/// @brief Writes out the records in all rings right away, so that they are
+///        not lost when exiting. It runs at exit once log_start is called,
+///        and before fatal errors are printed. It keeps errno.
+void log_flush(void);
 
-#define LOG_ERROR(...) (PRINTE("[ERROR] "), PRINTE(__VA_ARGS__), PRINTE("\n"))
+#define LOG_DEBUG(...) log_record("[DEBUG] ", __func__, __LINE__, __VA_ARGS__)
 
-#define LOG_FATAL(...) (PRINTE("[FATAL] "), PRINTE(__VA_ARGS__), PRINTE("\n"))
+#define LOG_INFO(...) log_record("[INFO] ", NULL, 0, __VA_ARGS__)
+
+#define LOG_WARN(...) log_record("[WARN] ", NULL, 0, __VA_ARGS__)
+
+#define LOG_ERROR(...) log_record("[ERROR] ", NULL, 0, __VA_ARGS__)
+
+/// Access log line, it is always on.
+#define LOG_ACCESS(...) log_record(NULL, NULL, 0, __VA_ARGS__)
+
+// Fatal errors are always written to stderr directly, since we exit next.
+// Records logged before are flushed first, to keep them in order.
+#define LOG_FATAL(...) \
+	(log_flush(), PRINTE("[FATAL] "), PRINTE(__VA_ARGS__), PRINTE("\n"))
 
 /// Prints errno with reason and exits the program.
 #define ERRNO_FATAL(prefix)                                                  \
-	(PRINTE(                                                                 \
+	(log_flush(),                                                            \
+	 PRINTE(                                                                 \
 		 "%s:%d [FATAL] %s: %s (OS error %d)\n", __func__, __LINE__, prefix, \
 		 strerror(errno), errno                                              \
 	 ),                                                                      \
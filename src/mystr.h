@@ -97,7 +97,7 @@ static inline bool string_append(StringBuilder *s, String t)
 /// @return false if there is no space in `s`, otherwise true.
 static inline bool string_append_number(StringBuilder *s, unsigned long num)
 {
-	static char buffer[64]; // Enough even for a 128-bit number
+	char buffer[64]; // Enough even for a 128-bit number
 	int len = 0;
 
 	if (num == 0)
@@ -0,0 +1,226 @@
+/**
+ * @file clock.c
+ * @brief Coarse per-thread clock with cached formatted timestamps.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "logger.h"
+#include "mystr.h"
+#include "server/clock.h"
+
+typedef struct Clock {
+	time_t now;
+	uint64_t mono_ms;
+	char http_date[32];
+	int http_date_len;
+	char log_time[32];
+} Clock;
+
+static _Thread_local Clock clock_state = {.now = -1};
+
+static const char DAY_NAMES[] = "SunMonTueWedThuFriSat";
+static const char MONTH_NAMES[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+/// @brief Converts a date of the proleptic Gregorian calendar to days since
+///        the epoch. Dates are converted with integer arithmetic, so that
+///        neither conversion takes the lock glibc holds for gmtime_r.
+/// @param m Month, 1 to 12.
+static long days_from_civil(long y, int m, int d)
+{
+	// Years are counted from March, so that the leap day is the last one.
+	y -= m <= 2;
+	long era = (y >= 0 ? y : y - 399) / 400;
+	long yoe = y - era * 400;
+	long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/// @brief Converts days since the epoch to a date, see days_from_civil.
+static void civil_from_days(long days, long *y, int *m, int *d)
+{
+	days += 719468;
+	long era = (days >= 0 ? days : days - 146096) / 146097;
+	long doe = days - era * 146097;
+	long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	long mp = (5 * doy + 2) / 153;
+	*d = doy - (153 * mp + 2) / 5 + 1;
+	*m = mp < 10 ? mp + 3 : mp - 9;
+	*y = yoe + era * 400 + (*m <= 2);
+}
+
+static void put_digits(char *at, long num, int width)
+{
+	for (int i = width - 1; i >= 0; --i, num /= 10)
+		at[i] = num % 10 + '0';
+}
+
+String clock_format_http_date(time_t t, char *buffer)
+{
+	long days = t / 86400;
+	long secs = t % 86400;
+	if (secs < 0)
+		days--, secs += 86400;
+
+	long year = 0;
+	int month = 0, day = 0;
+	civil_from_days(days, &year, &month, &day);
+	// The epoch was a Thursday.
+	int wday = (days % 7 + 11) % 7;
+
+	// <WWW>, <DD> <MMM> <YYYY> <HH>:<MM>:<SS> GMT
+	memcpy(buffer, "Www, DD Mmm YYYY HH:MM:SS GMT", HTTP_DATE_LEN);
+	memcpy(buffer, DAY_NAMES + wday * 3, 3);
+	put_digits(buffer + 5, day, 2);
+	memcpy(buffer + 8, MONTH_NAMES + (month - 1) * 3, 3);
+	put_digits(buffer + 12, year, 4);
+	put_digits(buffer + 17, secs / 3600, 2);
+	put_digits(buffer + 20, secs / 60 % 60, 2);
+	put_digits(buffer + 23, secs % 60, 2);
+	return STRING(buffer, HTTP_DATE_LEN);
+}
+
+/// @brief Parses a fixed number of digits.
+/// @return The number, -1 if any of them is not a digit.
+static int parse_digits(const char *at, int width)
+{
+	int num = 0;
+	for (int i = 0; i < width; ++i) {
+		if (at[i] < '0' || at[i] > '9')
+			return -1;
+		num = num * 10 + at[i] - '0';
+	}
+	return num;
+}
+
+/// @return Month from its three letter name, 1 to 12, -1 if invalid.
+static int parse_month(const char *at)
+{
+	for (int i = 0; i < 12; ++i)
+		if (memcmp(at, MONTH_NAMES + i * 3, 3) == 0)
+			return i + 1;
+	return -1;
+}
+
+bool clock_parse_http_date(String value, time_t *t)
+{
+	const char *s = value.data;
+	int day = 0, month = 0, year = 0;
+	// Time of day: <HH>:<MM>:<SS>
+	const char *tod = NULL;
+
+	if (value.len == HTTP_DATE_LEN && s[3] == ',') {
+		// IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT
+		if (s[4] != ' ' || s[7] != ' ' || s[11] != ' ' || s[16] != ' ' ||
+		    memcmp(s + 25, " GMT", 4) != 0)
+			return false;
+		day = parse_digits(s + 5, 2);
+		month = parse_month(s + 8);
+		year = parse_digits(s + 12, 4);
+		tod = s + 17;
+	} else if (value.len == 24 && s[3] == ' ') {
+		// asctime: Sun Nov  6 08:49:37 1994
+		if (s[7] != ' ' || s[10] != ' ' || s[19] != ' ')
+			return false;
+		month = parse_month(s + 4);
+		day = s[8] == ' ' ? parse_digits(s + 9, 1) : parse_digits(s + 8, 2);
+		year = parse_digits(s + 20, 4);
+		tod = s + 11;
+	} else {
+		// RFC 850: Sunday, 06-Nov-94 08:49:37 GMT
+		int comma = string_findc(value, ',');
+		if (comma < 6 || value.len - comma != 24)
+			return false;
+		const char *at = s + comma + 1;
+		if (at[0] != ' ' || at[3] != '-' || at[7] != '-' || at[10] != ' ' ||
+		    memcmp(at + 19, " GMT", 4) != 0)
+			return false;
+		day = parse_digits(at + 1, 2);
+		month = parse_month(at + 4);
+		year = parse_digits(at + 8, 2);
+		// Two digit years are taken to be within 1970 to 2069.
+		if (year >= 0)
+			year += year < 70 ? 2000 : 1900;
+		tod = at + 11;
+	}
+
+	if (tod[2] != ':' || tod[5] != ':')
+		return false;
+	int hour = parse_digits(tod, 2);
+	int minute = parse_digits(tod + 3, 2);
+	// 60 is a leap second.
+	int second = parse_digits(tod + 6, 2);
+	if (day < 1 || day > 31 || month < 0 || year < 0 || hour < 0 ||
+	    hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 60)
+		return false;
+
+	*t = days_from_civil(year, month, day) * 86400 + hour * 3600 +
+	     minute * 60 + second;
+	return true;
+}
+
+/// @brief Formats the timestamps for `now`.
+static void format_times(Clock *c, time_t now)
+{
+	struct tm tm;
+
+	clock_format_http_date(now, c->http_date);
+	c->http_date_len = HTTP_DATE_LEN;
+
+	localtime_r(&now, &tm);
+	strftime(c->log_time, sizeof c->log_time, "%F %T", &tm);
+}
+
+time_t clock_update(void)
+{
+	struct timespec ts;
+	// Coarse clock is read from the vDSO without a system call, it is
+	// accurate to a tick, which is plenty for second resolution.
+	if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) < 0)
+		ERRNO_FATAL("clock_gettime");
+
+	Clock *c = &clock_state;
+	if (ts.tv_sec != c->now) {
+		// localtime_r is not required to pick up the timezone by itself.
+		if (c->now < 0)
+			tzset();
+		format_times(c, ts.tv_sec);
+		c->now = ts.tv_sec;
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) < 0)
+		ERRNO_FATAL("clock_gettime");
+	c->mono_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	return c->now;
+}
+
+time_t clock_now(void)
+{
+	if (clock_state.now < 0)
+		return clock_update();
+	return clock_state.now;
+}
+
+uint64_t clock_mono_ms(void)
+{
+	clock_now();
+	return clock_state.mono_ms;
+}
+
+String clock_http_date(void)
+{
+	clock_now();
+	return STRING(clock_state.http_date, clock_state.http_date_len);
+}
+
+const char *clock_log_time(void)
+{
+	clock_now();
+	return clock_state.log_time;
+}
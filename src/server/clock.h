@@ -0,0 +1,52 @@
+#ifndef CLOCK_H_INCLUDED
+#define CLOCK_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "common.h"
+#include "mystr.h"
+
+/// @brief Per event loop wall clock with a resolution of one second. It is
+///        refreshed by the event loop after every wakeup, timestamps for
+///        responses and logs are formatted only when the second changes and
+///        are shared by everything served on that loop.
+
+/// @brief Reads the coarse clock and reformats the timestamps if the second
+///        has changed since the last update on the calling thread.
+/// @return Current time in seconds since the epoch.
+time_t clock_update(void);
+
+/// @brief Returns the time as of the last update on the calling thread.
+time_t clock_now(void);
+
+/// @brief Returns the monotonic time in milliseconds as of the last update
+///        on the calling thread, for timeouts.
+uint64_t clock_mono_ms(void);
+
+/// @brief Returns the current time in HTTP-date format, like:
+///        "Sun, 06 Nov 1994 08:49:37 GMT". It is valid until the next update.
+String clock_http_date(void);
+
+/// @brief Length of an HTTP-date in its preferred format, IMF-fixdate.
+#define HTTP_DATE_LEN 29
+
+/// @brief Formats a time as an HTTP-date, like the one of clock_http_date.
+/// @param t Seconds since the epoch.
+/// @param buffer At least HTTP_DATE_LEN bytes.
+/// @return The date, pointing into the buffer.
+String clock_format_http_date(time_t t, char *buffer);
+
+/// @brief Parses an HTTP-date in any of the three formats recipients must
+///        accept: IMF-fixdate, the obsolete RFC 850 format and asctime.
+/// @param value Like: "Sun, 06 Nov 1994 08:49:37 GMT"
+/// @param t Set to seconds since the epoch.
+/// @return false if the date is invalid.
+bool clock_parse_http_date(String value, time_t *t);
+
+/// @brief Returns the current local time for log lines, like:
+///        "1994-11-06 08:49:37". It is valid until the next update.
+const char *clock_log_time(void);
+
+#endif
@@ -3,6 +3,8 @@
  * @brief Asynchronous TCP socket server for Linux.
  */
 
+#define _GNU_SOURCE // For accept4
+
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
@@ -11,9 +13,11 @@
 #include <string.h>
 #include <time.h>
 #include <inttypes.h>
-#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -21,22 +25,110 @@
 #include "common.h"
 #include "config.h"
 #include "logger.h"
+#include "stats.h"
+#include "trace.h"
 #include "memory.h"
 #include "coroless.h"
 #include "server/server.h"
+#include "server/clock.h"
 #include "io/bufio.h"
+#include "io/uring.h"
+
+/// @brief Non-connection FD added to the event loop.
+typedef struct FDWatcher {
+	int fd;
+	FDCallback callback;
+	void *data;
+} FDWatcher;
+
+/// @brief Listening socket of a server.
+typedef struct Listener {
+	int sock_fd;
+	IPv4Address addr;
+	// A multishot accept is active, io_uring only.
+	bool is_armed;
+} Listener;
+
+/// @brief Connections along with their coro data, allocated together.
+typedef struct ConnectionChunk {
+	Connection connections[CONNECTIONS_CHUNK];
+	char *coro_data;
+} ConnectionChunk;
+
+/// @brief Kind of request a completion is for, kept in the low bits of its
+///        user_data. For connections the slot and generation are above it.
+enum UringTag {
+	TAG_ACCEPT,
+	TAG_POLL,
+	TAG_RECV,
+	TAG_WATCHER,
+	TAG_CANCEL,
+	TAG_BITS = 3,
+};
+
+/// @brief State of the io_uring backend.
+typedef struct UringLoop {
+	Uring ring;
+	UringBufRing buffers;
+	// Per buffer: length of received data and ID of the next buffer in the
+	// inbox holding it.
+	int *buffer_len;
+	int *buffer_next;
+	// Connections whose multishot receive stopped for lack of buffers,
+	// linked through `inbox.next_stalled`. -1 if none.
+	int stalled_head;
+	// A buffer was given back since the last time stalled ones were re-armed.
+	bool has_recycled;
+} UringLoop;
 
 /// @brief The TCP Server along with HTTP-request state
 typedef struct Server {
-	int sock_fd;
+	// Every worker listens on all addresses, connections from all of them
+	// share the connection table.
+	Listener listeners[LISTENERS_MAX];
+	int listener_cnt;
+	// Either epoll_fd is valid or uring is non-NULL.
 	int epoll_fd;
+	UringLoop *uring;
+	int events_max;
 	int active_cnt;
-	IPv4Address listen_addr;
-	Connection connections[CONNECTIONS_MAX];
+	int watcher_cnt;
+	FDWatcher watchers[WATCHERS_MAX];
+
+	// Connection table, it grows one chunk at a time upto `conn_max`
+	// connections. Connections never move, so pointers to them stay valid.
+	ConnectionChunk **chunks;
+	int chunk_cnt;
+	int conn_max;
+	// Slot of the first free connection, -1 if there is none.
+	int free_head;
+	size_t coro_data_size;
+	SocketProfile profile;
+	// Deadlines of connections.
+	TimerWheel timers;
+	const ServerHandler *handler;
+
+	// Overload state, see OverloadPolicy. Accepting is paused while the
+	// table is full, with OVERLOAD_QUEUE only.
+	bool is_accept_paused;
+	// The table has been full, queue delays of accepted connections are
+	// checked until one is below target.
+	bool is_congested;
+	// Time since which queue delays were above target, 0 if the last one
+	// was below it.
+	uint64_t above_target_ms;
+	// Connections accepted by io_uring after the table filled up, before
+	// the pause took effect. They are served first once slots free up.
+	int parked[PARKED_MAX];
+	int parked_head;
+	int parked_cnt;
 } Server;
 
 #define AS_SADDRP(addrp) ((struct sockaddr *)(addrp))
 
+// Server of the event loop running on this thread.
+static _Thread_local Server *loop_server = NULL;
+
 static IPv4Address sockaddr_to_ipv4_addr(struct sockaddr_in *addrp)
 {
 	// sin_addr part is stored in network byte order(big-endian).
@@ -52,7 +144,7 @@ static IPv4Address sockaddr_to_ipv4_addr(struct sockaddr_in *addrp)
 
 static struct sockaddr_in ipv4_addr_to_sockaddr(IPv4Address addr)
 {
-	uint32_t net_addr = addr.a << 24 | addr.b << 24 | addr.c << 8 | addr.d;
+	uint32_t net_addr = addr.a << 24 | addr.b << 16 | addr.c << 8 | addr.d;
 
 	return (struct sockaddr_in){
 		.sin_addr.s_addr = htonl(net_addr),
@@ -60,28 +152,148 @@ static struct sockaddr_in ipv4_addr_to_sockaddr(IPv4Address addr)
 	};
 }
 
-static Connection *find_free_connection(Connection *list, int size)
+static Connection *get_connection(Server *s, int slot)
+{
+	return &s->chunks[slot / CONNECTIONS_CHUNK]
+	            ->connections[slot % CONNECTIONS_CHUNK];
+}
+
+/// @brief Adds a chunk of free connections to the table.
+/// @return false if the table is already at its max size.
+static bool grow_connections(Server *s)
 {
-	Connection *ret = list;
-	while (ret->is_open) {
-		ret++;
-		(void)size; // assert not in release mode, so prevent unused warning.
-		assert(ret - list < size);
+	int capacity = s->chunk_cnt * CONNECTIONS_CHUNK;
+	if (capacity >= s->conn_max)
+		return false;
+
+	ConnectionChunk **chunks =
+		realloc(s->chunks, (s->chunk_cnt + 1) * sizeof(ConnectionChunk *));
+	if (chunks == NULL)
+		ERRNO_FATAL("realloc");
+	s->chunks = chunks;
+
+	ConnectionChunk *chunk = ALLOCATE(ConnectionChunk);
+	if (chunk == NULL)
+		ERRNO_FATAL("calloc");
+	chunk->coro_data =
+		ALLOCATE_SIZED_ARRAY(s->coro_data_size, CONNECTIONS_CHUNK);
+	if (chunk->coro_data == NULL)
+		ERRNO_FATAL("calloc");
+	s->chunks[s->chunk_cnt++] = chunk;
+
+	// Free slots are linked in order, the last one to the existing list.
+	for (int i = 0; i < CONNECTIONS_CHUNK; ++i) {
+		Connection *conn = &chunk->connections[i];
+		conn->coro_ctx.data = chunk->coro_data + i * s->coro_data_size;
+		conn->coro_ctx.data_size = s->coro_data_size;
+		conn->slot = capacity + i;
+		conn->next_free =
+			i + 1 < CONNECTIONS_CHUNK ? capacity + i + 1 : s->free_head;
 	}
+	s->free_head = capacity;
 
-	return ret;
+	return true;
 }
 
-static int setnonblocking(int fd) { return fcntl(fd, F_SETFL, O_NONBLOCK); }
+/// @brief Takes a free connection from the table, growing it if needed.
+/// @return NULL if all connections are in use.
+static Connection *alloc_connection(Server *s)
+{
+	if (s->free_head < 0 && !grow_connections(s))
+		return NULL;
+
+	Connection *conn = get_connection(s, s->free_head);
+	s->free_head = conn->next_free;
+	conn->generation++;
+	return conn;
+}
 
-/// @brief Initializes the server and binds it to the specified address.
-/// @param s Pointer to server
-/// @param addr_ipv4
-/// @param port
-/// @return 0 on success, -1 on failure
-int server_init(Server *s, IPv4Address address)
+static void release_inbox(Server *s, Connection *conn);
+static void arm_accept(Server *s, int index);
+static void cancel_request(Server *s, uint64_t user_data);
+static void pause_accept(Server *s);
+static void resume_accept(Server *s);
+
+/// @brief Puts a closed connection back to the freelist.
+static void free_connection(Server *s, Connection *conn)
+{
+	assert(!conn->is_open);
+	TRACE_CONN_PHASE(conn->slot, TRACE_CLOSE);
+	if (s->uring != NULL)
+		release_inbox(s, conn);
+	timer_stop(&s->timers, &conn->timeout);
+	conn->next_free = s->free_head;
+	s->free_head = conn->slot;
+	s->active_cnt--;
+	stats_set(STAT_ACTIVE, s->active_cnt);
+	if (s->is_accept_paused && s->parked_cnt == 0)
+		resume_accept(s);
+}
+
+/// @brief Sets the options of a profile on a listening socket.
+static void apply_socket_profile(int sock_fd, const SocketProfile *p)
 {
+	int val = p->nodelay;
+	if (setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof val) < 0)
+		ERRNO_FATAL("setsockopt TCP_NODELAY");
+
+	val = p->defer_accept;
+	if (val > 0 &&
+	    setsockopt(sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &val, sizeof val) < 0)
+		ERRNO_FATAL("setsockopt TCP_DEFER_ACCEPT");
+
+	// Fast Open may be disabled system wide, connections still work.
+	val = p->fastopen;
+	if (val > 0 &&
+	    setsockopt(sock_fd, IPPROTO_TCP, TCP_FASTOPEN, &val, sizeof val) < 0)
+		LOG_WARN("TCP Fast Open is not available: %s", strerror(errno));
+
+	// Buffer sizes must be set before listening, so that accepted
+	// connections use a window scale that fits them.
+	val = p->sndbuf;
+	if (val > 0 &&
+	    setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &val, sizeof val) < 0)
+		ERRNO_FATAL("setsockopt SO_SNDBUF");
+	val = p->rcvbuf;
+	if (val > 0 &&
+	    setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof val) < 0)
+		ERRNO_FATAL("setsockopt SO_RCVBUF");
+}
 
+/// @brief Sets up io_uring along with its provided buffer ring.
+/// @return NULL if io_uring is not available, errno tells why.
+static UringLoop *create_uring_loop(void)
+{
+	UringLoop *u = ALLOCATE(UringLoop);
+	if (u == NULL)
+		ERRNO_FATAL("calloc");
+
+	if (!uring_init(&u->ring, URING_ENTRIES)) {
+		FREE(u);
+		return NULL;
+	}
+	if (!uring_setup_buf_ring(
+			&u->ring, &u->buffers, 0, URING_BUFFERS, URING_BUFFER_SIZE
+		)) {
+		int err = errno;
+		close(u->ring.fd);
+		FREE(u);
+		errno = err;
+		return NULL;
+	}
+
+	u->buffer_len = ALLOCATE_ARRAY(int, URING_BUFFERS);
+	u->buffer_next = ALLOCATE_ARRAY(int, URING_BUFFERS);
+	if (u->buffer_len == NULL || u->buffer_next == NULL)
+		ERRNO_FATAL("calloc");
+	u->stalled_head = -1;
+
+	return u;
+}
+
+/// @brief Creates a listening socket bound to the address.
+static Listener open_listener(IPv4Address address, const SocketProfile *profile)
+{
 	struct sockaddr_in sock_addr = ipv4_addr_to_sockaddr(address);
 	sock_addr.sin_family = AF_INET;
 
@@ -94,33 +306,64 @@ int server_init(Server *s, IPv4Address address)
 	int val = 1;
 	setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
 	// #endif
+	// Every worker binds its own listening socket to the same address,
+	// the kernel then distributes incoming connections among them.
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0)
+		ERRNO_FATAL("setsockopt SO_REUSEPORT");
 
-	if (bind(sock_fd, AS_SADDRP(&sock_addr), sizeof sock_addr) < 0)
-		ERRNO_FATAL("bind");
+	apply_socket_profile(sock_fd, profile);
 
-	// Create epoll
-	// We add server FD to epoll when we start listening on it, not here.
-	int epoll_fd = epoll_create1(0);
-	if (epoll_fd < 0)
-		ERRNO_FATAL("epoll_create1");
+	// The address tells which one of them failed.
+	if (bind(sock_fd, AS_SADDRP(&sock_addr), sizeof sock_addr) < 0)
+		ERRNO_FATAL(fmt_ipv4_addr(address));
 
 	// Query the address again, in case the user provides 0 for port number,
 	// OS assigns a random free port to it.
 	socklen_t size = sizeof(struct sockaddr_in);
 	getsockname(sock_fd, AS_SADDRP(&sock_addr), &size);
 
+	return (Listener){
+		.sock_fd = sock_fd,
+		.addr = sockaddr_to_ipv4_addr(&sock_addr),
+	};
+}
+
+/// @brief Initializes the server and binds it to the addresses.
+/// @param s Pointer to server
+/// @param o Options, see ServerOptions.
+/// @return 0 on success, -1 on failure
+int server_init(Server *s, const ServerOptions *o)
+{
+	assert(o->connections_max > 0);
+	assert(o->listen_cnt > 0 && o->listen_cnt <= LISTENERS_MAX);
+
 	*s = (Server){
 		.active_cnt = 0,
-		.epoll_fd = epoll_fd,
-		.sock_fd = sock_fd,
-		.listen_addr = sockaddr_to_ipv4_addr(&sock_addr),
+		.conn_max = o->connections_max,
+		.events_max = o->events_max,
+		.free_head = -1,
+		.profile = o->profile,
+		.listener_cnt = o->listen_cnt,
 	};
+	for (int i = 0; i < o->listen_cnt; ++i)
+		s->listeners[i] = open_listener(o->listen[i], &o->profile);
+
+	UringLoop *uring = NULL;
+	if (o->backend == BACKEND_IO_URING && (uring = create_uring_loop()) == NULL)
+		LOG_WARN("io_uring is not available, using epoll: %s", strerror(errno));
+
+	// Create epoll
+	// We add server FDs to epoll when we start listening on them, not here.
+	int epoll_fd = -1;
+	if (uring == NULL && (epoll_fd = epoll_create1(0)) < 0)
+		ERRNO_FATAL("epoll_create1");
 
+	s->uring = uring;
+	s->epoll_fd = epoll_fd;
 	return 0;
 }
 
-Server *server_create(IPv4Address addr)
-
+Server *server_create(const ServerOptions *o)
 {
 	Server *s = ALLOCATE(Server);
 	if (!s) {
@@ -128,14 +371,14 @@ Server *server_create(IPv4Address addr)
 		return NULL;
 	}
 
-	server_init(s, addr);
+	server_init(s, o);
 	return s;
 }
 
 const char *fmt_ipv4_addr(IPv4Address addr)
 {
 	// Enough for: "xxx.xxx.xxx.xxx:ppppp\0"
-	static char addr_str[32];
+	static _Thread_local char addr_str[32];
 
 	snprintf(
 		addr_str, sizeof addr_str, "%u.%u.%u.%u:%u", addr.a, addr.b, addr.c,
@@ -145,13 +388,39 @@ const char *fmt_ipv4_addr(IPv4Address addr)
 	return addr_str;
 }
 
+/// @brief Closes a connection whose coro has not completed yet.
+static void abort_connection(Connection *conn, const ServerHandler *handler)
+{
+	// Let the coro release whatever it holds, it won't be resumed.
+	if (conn->coro_ctx.step != -1 && handler->abort != NULL)
+		handler->abort(&conn->coro_ctx, conn);
+	close_connection(conn);
+}
+
+/// @brief Closes a connection whose deadline has passed, it is a
+///        TimerCallback with the handler as context.
+static void expire_connection(TimerNode *t, void *ctx)
+{
+	const ServerHandler *handler = ctx;
+	Connection *conn =
+		(Connection *)((char *)t - offsetof(Connection, timeout));
+
+	LOG_DEBUG("Connection timed out %s", fmt_ipv4_addr(conn->addr));
+	stats_add(STAT_TIMED_OUT, 1);
+	abort_connection(conn, handler);
+	free_connection(loop_server, conn);
+}
+
 int handle_conn_event(
-	Server *s, Connection *conn, uint32_t events, ConnCallback callback
+	Server *s, Connection *conn, uint32_t events, const ServerHandler *handler
 )
 {
+	TRACE_SET_CONN(conn->slot);
+	TRACE_PHASE(TRACE_WAKE);
+
 	if (events & EPOLLIN || events & EPOLLOUT) {
 		int result = 0;
-		CORO_RUN(result, callback(&conn->coro_ctx, conn));
+		CORO_RUN(result, handler->callback(&conn->coro_ctx, conn));
 		if (result == CORO_SYS_ERROR)
 			ERRNO_FATAL("coro for connection failed");
 		if (result == CORO_DONE && conn->is_open)
@@ -160,29 +429,163 @@ int handle_conn_event(
 
 	// If sender hangs up
 	if (events & EPOLLRDHUP && conn->is_open)
-		close_connection(conn);
+		abort_connection(conn, handler);
 
 	// Closed FDs are auto removed from epoll interest list.
 	if (!conn->is_open) {
 		// A connection pointer always refers to server's list of connections.
 		conn->is_open = false;
-		s->active_cnt--;
+		free_connection(s, conn);
 	}
 
 	return 0;
 }
 
+/// @brief Takes a slot for an accepted connection, one must be free.
+static Connection *
+open_connection(Server *s, int conn_fd, struct sockaddr_in *conn_addr)
+{
+	Connection *conn = alloc_connection(s);
+	assert(conn != NULL);
+	s->active_cnt++;
+	stats_add(STAT_ACCEPTED, 1);
+	stats_set(STAT_ACTIVE, s->active_cnt);
+	TRACE_CONN_PHASE(conn->slot, TRACE_ACCEPT);
+	if (s->active_cnt == s->conn_max &&
+	    s->handler->overload == OVERLOAD_QUEUE && !s->is_accept_paused)
+		pause_accept(s);
+
+	CORO_INIT(&conn->coro_ctx);
+	conn->addr = sockaddr_to_ipv4_addr(conn_addr);
+	conn->sock_fd = conn_fd;
+	conn->is_open = true;
+
+	LOG_DEBUG("Connection recieved %s", fmt_ipv4_addr(conn->addr));
+	return conn;
+}
+
+/// @brief Stops accepting until a connection closes, the kernel queues new
+///        connections meanwhile.
+static void pause_accept(Server *s)
+{
+	s->is_accept_paused = true;
+	s->is_congested = true;
+	stats_add(STAT_OVERLOAD_PAUSED, 1);
+
+	for (int i = 0; i < s->listener_cnt; ++i) {
+		Listener *l = &s->listeners[i];
+		if (s->uring != NULL) {
+			cancel_request(s, (uint64_t)i << TAG_BITS | TAG_ACCEPT);
+			continue;
+		}
+		struct epoll_event event = {.events = 0, .data.ptr = l};
+		if (epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, l->sock_fd, &event) < 0)
+			ERRNO_FATAL("epoll_ctl");
+	}
+}
+
+static void resume_accept(Server *s)
+{
+	s->is_accept_paused = false;
+
+	for (int i = 0; i < s->listener_cnt; ++i) {
+		Listener *l = &s->listeners[i];
+		if (s->uring != NULL) {
+			if (!l->is_armed)
+				arm_accept(s, i);
+			continue;
+		}
+		struct epoll_event event = {.events = EPOLLIN, .data.ptr = l};
+		if (epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, l->sock_fd, &event) < 0)
+			ERRNO_FATAL("epoll_ctl");
+	}
+}
+
+/// @brief Closes an accepted connection without serving it.
+static void refuse_connection(Server *s, int conn_fd, enum StatCounter stat)
+{
+	stats_add(stat, 1);
+
+	if (s->handler->overload == OVERLOAD_RESET) {
+		// Closing with a zero linger time sends a reset.
+		struct linger linger = {.l_onoff = 1, .l_linger = 0};
+		setsockopt(conn_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+	} else if (s->handler->overload_response != NULL) {
+		send(
+			conn_fd, s->handler->overload_response,
+			s->handler->overload_response_len, MSG_DONTWAIT | MSG_NOSIGNAL
+		);
+		// Closing with unread data sends a reset, which can make the peer
+		// lose the response. Whatever has arrived is discarded first.
+		char discard[BUFFER_SIZE];
+		shutdown(conn_fd, SHUT_WR);
+		recv(conn_fd, discard, sizeof discard, MSG_DONTWAIT);
+	}
+	close(conn_fd);
+}
+
+/// @brief Returns milliseconds an accepted connection waited in the listen
+///        queue. Nothing has been sent on it since the handshake, so that is
+///        the time since the last data sent.
+static unsigned queue_delay_ms(int conn_fd)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof info;
+	if (getsockopt(conn_fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+		return 0;
+	return info.tcpi_last_data_sent;
+}
+
+/// @brief Decides whether to serve an accepted connection, it is refused
+///        and closed if the server is overloaded.
+/// @return true if it is to be served.
+static bool admit_connection(Server *s, int conn_fd)
+{
+	if (s->active_cnt == s->conn_max) {
+		bool is_reset = s->handler->overload == OVERLOAD_RESET;
+		refuse_connection(
+			s, conn_fd, is_reset ? STAT_OVERLOAD_RESET : STAT_OVERLOAD_REFUSED
+		);
+		return false;
+	}
+	if (s->handler->overload != OVERLOAD_QUEUE || !s->is_congested)
+		return true;
+
+	// Like CoDel, refuse only if the delay has been above target for an
+	// interval, short bursts are served from the queue.
+	uint64_t now = clock_mono_ms();
+	if (queue_delay_ms(conn_fd) < OVERLOAD_DELAY_TARGET) {
+		s->is_congested = false;
+		s->above_target_ms = 0;
+		return true;
+	}
+	if (s->above_target_ms == 0)
+		s->above_target_ms = now;
+	if (now - s->above_target_ms < OVERLOAD_DELAY_INTERVAL)
+		return true;
+
+	refuse_connection(s, conn_fd, STAT_OVERLOAD_DROPPED);
+	return false;
+}
+
 /// @brief Accepts a single connection if available
 /// @param s
-/// @return Returns 1 if connection accepted, -1 on error and 0 otherwise.
-int handle_server_event(Server *s)
+/// @param l Listener to accept from.
+/// @return Returns 1 if connection accepted or refused, -1 on error and 0
+///         otherwise.
+int handle_server_event(Server *s, Listener *l)
 {
-	if (s->active_cnt == CONNECTIONS_MAX)
+	// Its readiness may have been reported before the pause.
+	if (s->is_accept_paused)
 		return 0;
 
 	struct sockaddr_in conn_addr = {0};
 	socklen_t addr_len = sizeof conn_addr;
-	int conn_fd = accept(s->sock_fd, AS_SADDRP(&conn_addr), &addr_len);
+	// The connection is made non-blocking by the same system call.
+	int conn_fd = accept4(
+		l->sock_fd, AS_SADDRP(&conn_addr), &addr_len,
+		SOCK_NONBLOCK | SOCK_CLOEXEC
+	);
 
 	assert(addr_len == sizeof conn_addr);
 	if (conn_fd < 0) {
@@ -191,19 +594,11 @@ int handle_server_event(Server *s)
 			return 0;
 		ERRNO_FATAL("accept");
 	}
-	// Make the connection async
-	if (setnonblocking(conn_fd) < 0)
-		ERRNO_FATAL("setnonblocking");
-
-	// Find an empty slot, it must exist since we check for it above.
-	Connection *conn = find_free_connection(s->connections, CONNECTIONS_MAX);
-	s->active_cnt++;
+	if (!admit_connection(s, conn_fd))
+		return 1;
 
-	CORO_INIT(&conn->coro_ctx);
-	conn->addr = sockaddr_to_ipv4_addr(&conn_addr);
-	conn->sock_fd = conn_fd;
-	conn->is_open = true;
-	conn->estb_time = time(NULL);
+	// A free slot must exist since we check for it above.
+	Connection *conn = open_connection(s, conn_fd, &conn_addr);
 
 	// We want to detect read/write availability and if the connection was closed.
 	struct epoll_event event = {
@@ -213,7 +608,6 @@ int handle_server_event(Server *s)
 	if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, conn_fd, &event) < 0)
 		ERRNO_FATAL("epoll_ctl");
 
-	LOG_DEBUG("Connection recieved %s", fmt_ipv4_addr(conn->addr));
 	return 1;
 }
 
@@ -223,58 +617,531 @@ int handle_server_event(Server *s)
 // 	return e.tv_sec - s.tv_sec + (nano_diff / 1000000000.0);
 // }
 
-int server_listen(Server *s, ConnCallback callback, size_t data_size)
+static uint64_t conn_user_data(const Connection *conn, enum UringTag tag)
+{
+	return (uint64_t)conn->generation << 32 | (uint64_t)conn->slot << TAG_BITS |
+	       tag;
+}
+
+/// @brief Returns the connection a completion is for, NULL if it has been
+///        closed since the request was made.
+static Connection *conn_from_user_data(Server *s, uint64_t user_data)
+{
+	int slot = (uint32_t)user_data >> TAG_BITS;
+	Connection *conn = get_connection(s, slot);
+	if (!conn->is_open || conn->generation != user_data >> 32)
+		return NULL;
+	return conn;
+}
+
+/// @brief Accepts on the listener at `index`, its completions carry it.
+static void arm_accept(Server *s, int index)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&s->uring->ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = s->listeners[index].sock_fd;
+	// While congested, connections are accepted one at a time, so that
+	// none is taken out of the listen queue once the table is full again.
+	if (!s->is_congested)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = (uint64_t)index << TAG_BITS | TAG_ACCEPT;
+	s->listeners[index].is_armed = true;
+}
+
+/// @brief Watches the connection for writability, reads are completions.
+static void arm_poll(Server *s, Connection *conn)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&s->uring->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = conn->sock_fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = conn_user_data(conn, TAG_POLL);
+}
+
+static void arm_recv(Server *s, Connection *conn)
 {
-	struct epoll_event events[EVENTS_MAX] = {0};
+	struct io_uring_sqe *sqe = uring_get_sqe(&s->uring->ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->sock_fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = s->uring->buffers.group;
+	sqe->user_data = conn_user_data(conn, TAG_RECV);
+	conn->inbox.is_armed = true;
+}
+
+static void arm_watcher(Server *s, int index)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&s->uring->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = s->watchers[index].fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = (uint64_t)index << TAG_BITS | TAG_WATCHER;
+}
+
+static void cancel_request(Server *s, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&s->uring->ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = user_data;
+	sqe->user_data = TAG_CANCEL;
+}
+
+static void recycle_buffer(UringLoop *u, int bid)
+{
+	uring_recycle_buffer(&u->buffers, bid);
+	u->has_recycled = true;
+}
+
+/// @brief Gives back buffers of a closed connection and stops its requests.
+static void release_inbox(Server *s, Connection *conn)
+{
+	UringLoop *u = s->uring;
+	RecvInbox *in = &conn->inbox;
+
+	while (in->head >= 0) {
+		int bid = in->head;
+		in->head = u->buffer_next[bid];
+		recycle_buffer(u, bid);
+	}
+
+	// Requests hold a reference to the socket, so it is not released until
+	// they are gone, even though its FD is closed.
+	cancel_request(s, conn_user_data(conn, TAG_POLL));
+	if (in->is_armed)
+		cancel_request(s, conn_user_data(conn, TAG_RECV));
+	in->is_armed = false;
+}
+
+/// @brief Takes received data out of a connection's inbox, it is a ReceiveFn.
+static int receive_from_inbox(void *ctx, char *buffer, int size)
+{
+	Connection *conn = ctx;
+	UringLoop *u = loop_server->uring;
+	RecvInbox *in = &conn->inbox;
+
+	int len = 0;
+	while (len < size && in->head >= 0) {
+		int bid = in->head;
+		int available = u->buffer_len[bid] - in->offset;
+		int n = available < size - len ? available : size - len;
+
+		memcpy(buffer + len, uring_buffer(&u->buffers, bid) + in->offset, n);
+		len += n;
+		in->offset += n;
+
+		if (in->offset == u->buffer_len[bid]) {
+			in->head = u->buffer_next[bid];
+			in->offset = 0;
+			recycle_buffer(u, bid);
+		}
+	}
+	if (in->head < 0)
+		in->tail = -1;
+
+	if (len > 0)
+		return len;
+	return in->is_eof ? CORO_IO_EOF : CORO_PENDING;
+}
+
+BufReader connection_reader(Connection *c)
+{
+	BufReader r = {.sock_fd = c->sock_fd, .is_eof = false};
+	if (loop_server->uring != NULL) {
+		r.receive = receive_from_inbox;
+		r.receive_ctx = c;
+	}
+	return r;
+}
+
+/// @brief Serves a connection accepted by io_uring, if it is admitted.
+static void open_uring_connection(Server *s, int conn_fd)
+{
+	// Accepts completed before a pause took effect wait for a free slot,
+	// or are refused if too many do.
+	if (s->active_cnt == s->conn_max &&
+	    s->handler->overload == OVERLOAD_QUEUE && s->parked_cnt < PARKED_MAX) {
+		s->parked[(s->parked_head + s->parked_cnt++) % PARKED_MAX] = conn_fd;
+		return;
+	}
+	if (!admit_connection(s, conn_fd))
+		return;
+
+	struct sockaddr_in conn_addr = {0};
+#if LOG_LEVEL >= 4
+	// Multishot accepts do not return the address, it is looked up only
+	// for logging, saving a system call per connection.
+	socklen_t addr_len = sizeof conn_addr;
+	getpeername(conn_fd, AS_SADDRP(&conn_addr), &addr_len);
+#endif
+
+	Connection *conn = open_connection(s, conn_fd, &conn_addr);
+	RecvInbox *in = &conn->inbox;
+	in->head = in->tail = -1;
+	in->offset = 0;
+	in->is_eof = false;
+	arm_poll(s, conn);
+	arm_recv(s, conn);
+}
+
+/// @brief Serves parked connections while there are free slots, accepting
+///        again once all of them are.
+static void open_parked(Server *s)
+{
+	while (s->parked_cnt > 0 && s->active_cnt < s->conn_max) {
+		int conn_fd = s->parked[s->parked_head];
+		s->parked_head = (s->parked_head + 1) % PARKED_MAX;
+		s->parked_cnt--;
+		open_uring_connection(s, conn_fd);
+	}
+
+	if (s->is_accept_paused && s->parked_cnt == 0 &&
+	    s->active_cnt < s->conn_max)
+		resume_accept(s);
+}
+
+static void handle_accept_cqe(Server *s, struct io_uring_cqe *cqe)
+{
+	int index = cqe->user_data >> TAG_BITS;
+	int conn_fd = cqe->res;
+	if (conn_fd >= 0)
+		open_uring_connection(s, conn_fd);
+	else if (conn_fd != -ECONNABORTED && conn_fd != -EAGAIN &&
+	         conn_fd != -ECANCELED)
+		LOG_WARN("accept: %s", strerror(-conn_fd));
+
+	// Accepting again only after the connection is opened, since that may
+	// have paused it.
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		s->listeners[index].is_armed = false;
+		if (!s->is_accept_paused)
+			arm_accept(s, index);
+	}
+}
+
+static void handle_recv_cqe(
+	Server *s, struct io_uring_cqe *cqe, const ServerHandler *handler
+)
+{
+	UringLoop *u = s->uring;
+	Connection *conn = conn_from_user_data(s, cqe->user_data);
+	bool has_buffer = cqe->flags & IORING_CQE_F_BUFFER;
+	int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+	if (conn == NULL) {
+		if (has_buffer)
+			recycle_buffer(u, bid);
+		return;
+	}
+
+	RecvInbox *in = &conn->inbox;
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		in->is_armed = false;
+
+	if (cqe->res == -ENOBUFS) {
+		// Received again once some buffer is given back.
+		if (!in->is_stalled) {
+			in->is_stalled = true;
+			in->next_stalled = u->stalled_head;
+			u->stalled_head = conn->slot;
+		}
+		return;
+	}
+
+	uint32_t events = EPOLLIN;
+	if (cqe->res > 0 && has_buffer) {
+		u->buffer_len[bid] = cqe->res;
+		u->buffer_next[bid] = -1;
+		if (in->tail >= 0)
+			u->buffer_next[in->tail] = bid;
+		else
+			in->head = bid;
+		in->tail = bid;
+		if (!in->is_armed)
+			arm_recv(s, conn);
+	} else {
+		// Peer closed or reset the connection.
+		if (has_buffer)
+			recycle_buffer(u, bid);
+		in->is_eof = true;
+		events |= EPOLLRDHUP;
+	}
+
+	handle_conn_event(s, conn, events, handler);
+}
+
+static void handle_poll_cqe(
+	Server *s, struct io_uring_cqe *cqe, const ServerHandler *handler
+)
+{
+	Connection *conn = conn_from_user_data(s, cqe->user_data);
+	if (conn == NULL)
+		return;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		arm_poll(s, conn);
+	handle_conn_event(s, conn, EPOLLOUT, handler);
+}
 
-	char *coro_data = ALLOCATE_SIZED_ARRAY(data_size, CONNECTIONS_MAX);
-	if (coro_data == NULL)
-		ERRNO_FATAL("malloc");
-	// Initialize data for all connection coros
-	for (int i = 0; i < CONNECTIONS_MAX; ++i) {
-		s->connections[i].coro_ctx.data = coro_data + i * data_size;
-		s->connections[i].coro_ctx.data_size = data_size;
+/// @brief Receives again for connections which ran out of buffers.
+static void rearm_stalled(Server *s)
+{
+	UringLoop *u = s->uring;
+	if (!u->has_recycled)
+		return;
+
+	u->has_recycled = false;
+	while (u->stalled_head >= 0) {
+		Connection *conn = get_connection(s, u->stalled_head);
+		u->stalled_head = conn->inbox.next_stalled;
+		conn->inbox.is_stalled = false;
+		if (conn->is_open && !conn->inbox.is_armed && !conn->inbox.is_eof)
+			arm_recv(s, conn);
+	}
+}
+
+void server_watch_fd(Server *s, int fd, FDCallback callback, void *data)
+{
+	if (s->watcher_cnt == WATCHERS_MAX) {
+		LOG_FATAL("Cannot watch more than %d FDs", WATCHERS_MAX);
+		abort();
+	}
+
+	FDWatcher *w = &s->watchers[s->watcher_cnt++];
+	*w = (FDWatcher){.fd = fd, .callback = callback, .data = data};
+
+	if (s->uring != NULL) {
+		arm_watcher(s, s->watcher_cnt - 1);
+		return;
 	}
 
-	// Register the server with epoll
 	struct epoll_event event = {
 		.events = EPOLLIN,
-		.data.ptr = s,
+		.data.ptr = w,
 	};
-	if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->sock_fd, &event) < 0)
+	if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
 		ERRNO_FATAL("epoll_ctl");
+}
 
-	// Start listening
-	if (listen(s->sock_fd, BACKLOG_MAX) < 0)
-		ERRNO_FATAL("listen");
-	LOG_INFO("Listening on %s", fmt_ipv4_addr(s->listen_addr));
+static bool is_watcher(Server *s, void *ptr)
+{
+	return (FDWatcher *)ptr >= s->watchers &&
+	       (FDWatcher *)ptr < s->watchers + WATCHERS_MAX;
+}
 
-	// Main event loop
+static bool is_listener(Server *s, void *ptr)
+{
+	return (Listener *)ptr >= s->listeners &&
+	       (Listener *)ptr < s->listeners + LISTENERS_MAX;
+}
+
+/// @brief Runs the event loop using epoll, it never returns.
+static void run_epoll_loop(Server *s, const ServerHandler *handler)
+{
+	struct epoll_event *events =
+		ALLOCATE_ARRAY(struct epoll_event, s->events_max);
+	if (events == NULL)
+		ERRNO_FATAL("calloc");
+
+	// Register the listeners with epoll
+	for (int i = 0; i < s->listener_cnt; ++i) {
+		struct epoll_event event = {
+			.events = EPOLLIN,
+			.data.ptr = &s->listeners[i],
+		};
+		if (epoll_ctl(
+				s->epoll_fd, EPOLL_CTL_ADD, s->listeners[i].sock_fd, &event
+			) < 0)
+			ERRNO_FATAL("epoll_ctl");
+	}
+
+	// Main event loop, it wakes up in time for the next connection deadline.
 	while (1) {
-		int event_cnt = epoll_wait(s->epoll_fd, events, EVENTS_MAX, -1);
-		if (event_cnt < 0)
+		int timeout = timer_next_timeout(&s->timers, clock_mono_ms());
+		int event_cnt = epoll_wait(s->epoll_fd, events, s->events_max, timeout);
+		if (event_cnt < 0 && errno != EINTR)
 			ERRNO_FATAL("epoll_wait");
+		// Everything handled for these events sees the same time.
+		clock_update();
 
 		for (int i = 0; i < event_cnt; ++i) {
 			struct epoll_event ev = events[i];
-			if (ev.data.ptr == s) {
-				// Accept as much as possible at once
-				while (handle_server_event(s) > 0)
-					/* nothing */;
+			if (is_listener(s, ev.data.ptr)) {
+				// Accept a batch at once, the listener is level-triggered
+				// so the rest wake the loop up again.
+				for (int n = 0; n < ACCEPT_BATCH_MAX; ++n)
+					if (handle_server_event(s, ev.data.ptr) <= 0)
+						break;
+			} else if (is_watcher(s, ev.data.ptr)) {
+				FDWatcher *w = ev.data.ptr;
+				w->callback(w->data);
 			} else {
-				handle_conn_event(s, ev.data.ptr, ev.events, callback);
+				handle_conn_event(s, ev.data.ptr, ev.events, handler);
 			}
 		}
+
+		timer_advance(
+			&s->timers, clock_mono_ms(), expire_connection, (void *)handler
+		);
 	}
+}
+
+/// @brief Runs the event loop using io_uring, it never returns. Requests
+///        made while handling completions are submitted together with a
+///        single system call, which also waits for the next completions.
+static void run_uring_loop(Server *s, const ServerHandler *handler)
+{
+	Uring *ring = &s->uring->ring;
+	for (int i = 0; i < s->listener_cnt; ++i)
+		arm_accept(s, i);
+
+	while (1) {
+		int timeout = timer_next_timeout(&s->timers, clock_mono_ms());
+		if (uring_enter(ring, timeout) < 0)
+			ERRNO_FATAL("io_uring_enter");
+		clock_update();
+
+		struct io_uring_cqe *cqe = NULL;
+		while ((cqe = uring_peek_cqe(ring)) != NULL) {
+			struct io_uring_cqe c = *cqe;
+			uring_cqe_seen(ring);
+
+			switch (c.user_data & ((1 << TAG_BITS) - 1)) {
+			case TAG_ACCEPT:
+				handle_accept_cqe(s, &c);
+				break;
+			case TAG_POLL:
+				handle_poll_cqe(s, &c, handler);
+				break;
+			case TAG_RECV:
+				handle_recv_cqe(s, &c, handler);
+				break;
+			case TAG_WATCHER: {
+				int index = c.user_data >> TAG_BITS;
+				if (!(c.flags & IORING_CQE_F_MORE))
+					arm_watcher(s, index);
+				s->watchers[index].callback(s->watchers[index].data);
+				break;
+			}
+			default:
+				break;
+			}
+		}
+		rearm_stalled(s);
+		if (s->parked_cnt > 0)
+			open_parked(s);
+
+		timer_advance(
+			&s->timers, clock_mono_ms(), expire_connection, (void *)handler
+		);
+	}
+}
+
+int server_listen(Server *s, const ServerHandler *handler)
+{
+	// Connections and their coro data are allocated as the table grows.
+	s->coro_data_size = handler->data_size;
+	s->handler = handler;
+	loop_server = s;
+	clock_update();
+	timer_wheel_init(&s->timers, clock_mono_ms());
+
+	if (handler->worker_init != NULL)
+		handler->worker_init(s);
+
+	// Start listening
+	for (int i = 0; i < s->listener_cnt; ++i) {
+		Listener *l = &s->listeners[i];
+		if (listen(l->sock_fd, s->profile.backlog) < 0)
+			ERRNO_FATAL("listen");
+		LOG_INFO(
+			"Listening on %s using %s", fmt_ipv4_addr(l->addr),
+			s->uring != NULL ? "io_uring" : "epoll"
+		);
+	}
+
+	if (s->uring != NULL)
+		run_uring_loop(s, handler);
+	else
+		run_epoll_loop(s, handler);
+
+	return 0;
+}
+
+/// @brief Per thread worker state
+typedef struct Worker {
+	pthread_t thread;
+	Server *server;
+	const ServerHandler *handler;
+} Worker;
+
+static void *worker_main(void *arg)
+{
+	Worker *w = arg;
+	server_listen(w->server, w->handler);
+	return NULL;
+}
+
+int server_run_workers(const ServerOptions *options, const ServerHandler *handler)
+{
+	int workers = options->workers;
+	assert(workers > 0);
+
+	// Writing to a socket closed by its peer must not kill us,
+	// sendfile does not have a MSG_NOSIGNAL flag like send.
+	signal(SIGPIPE, SIG_IGN);
+	TRACE_INIT();
+
+	Worker *list = ALLOCATE_ARRAY(Worker, workers);
+	if (list == NULL)
+		ERRNO_FATAL("calloc");
+
+	ServerOptions o = *options;
+	for (int i = 0; i < workers; ++i) {
+		list[i] = (Worker){
+			.server = server_create(&o),
+			.handler = handler,
+		};
+		// If port 0 was given, then all workers must use the port which
+		// the OS assigned to the first one.
+		for (int j = 0; j < o.listen_cnt; ++j)
+			o.listen[j] = list[i].server->listeners[j].addr;
+	}
+
+	// The calling thread runs the first worker itself.
+	for (int i = 1; i < workers; ++i) {
+		int err = pthread_create(&list[i].thread, NULL, worker_main, &list[i]);
+		if (err != 0) {
+			errno = err;
+			ERRNO_FATAL("pthread_create");
+		}
+	}
+
+	LOG_INFO("Started %d worker(s)", workers);
+	worker_main(&list[0]);
 
 	return 0;
 }
 
+void connection_set_timeout(Connection *c, int ms)
+{
+	if (ms > 0)
+		timer_start(&loop_server->timers, &c->timeout, clock_mono_ms() + ms);
+	else
+		timer_stop(&loop_server->timers, &c->timeout);
+}
+
 void close_connection(Connection *c)
 {
 	assert(c->is_open);
 
-	if (shutdown(c->sock_fd, SHUT_RDWR) < 0 && errno == ENOTCONN)
+	// Requests of io_uring keep the socket alive after its FD is closed,
+	// until they are cancelled. Shutdown ends the connection right away.
+	if (loop_server->uring != NULL && shutdown(c->sock_fd, SHUT_RDWR) < 0 &&
+	    errno == ENOTCONN)
 		LOG_DEBUG("Connection dropped  %s", fmt_ipv4_addr(c->addr));
 	else
 		LOG_DEBUG("Connection closed   %s", fmt_ipv4_addr(c->addr));
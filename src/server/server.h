@@ -3,9 +3,12 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
+#include "config.h"
 #include "coroless.h"
 #include "io/bufio.h"
+#include "server/timer.h"
 
 // Address as: a.b.c.d:port
 typedef struct IPv4Address {
@@ -22,35 +25,174 @@ typedef struct IPv4Address {
 ///         future calls to this function might modify it.
 const char *fmt_ipv4_addr(IPv4Address addr);
 
+/// @brief Mechanism used by an event loop for I/O readiness and completion.
+enum EventBackend {
+	// Edge-triggered epoll, connections read and write their sockets.
+	BACKEND_EPOLL,
+	// io_uring, connections are accepted and received from by the loop using
+	// multishot requests and a provided buffer ring. Writes are still done by
+	// connections. Falls back to epoll if io_uring is not available.
+	BACKEND_IO_URING,
+};
+
+/// @brief Options of listening sockets. Connections inherit them from the
+///        listening socket, so they cost no system calls per connection.
+typedef struct SocketProfile {
+	// Length of the listen queue.
+	int backlog;
+	// Seconds the kernel holds a connection until its first data arrives,
+	// so that it is accepted along with its request. 0 disables it.
+	int defer_accept;
+	// Length of the queue of pending TCP Fast Open requests, 0 disables it.
+	int fastopen;
+	// Disable Nagle's algorithm. Responses are written whole, and pieces of
+	// one are sent with MSG_MORE, which corks them without a system call.
+	bool nodelay;
+	// Socket buffer sizes in bytes, 0 keeps the system defaults.
+	int sndbuf;
+	int rcvbuf;
+} SocketProfile;
+
+#define SOCKET_PROFILE_DEFAULT \
+	((SocketProfile){.backlog = BACKLOG_MAX, .nodelay = true})
+
+/// @brief How servers are set up, see server_run_workers.
+typedef struct ServerOptions {
+	// Addresses to listen on, every worker listens on all of them. If a
+	// port is 0 then all workers share the port assigned by the OS.
+	IPv4Address listen[LISTENERS_MAX];
+	int listen_cnt;
+	// Number of worker threads, each running its own event loop.
+	int workers;
+	// Max number of connections served at once by each worker, its
+	// connection table grows upto it as needed.
+	int connections_max;
+	// Max number of events an epoll event loop handles per wakeup.
+	int events_max;
+	// Event backend to use, if available.
+	enum EventBackend backend;
+	// Options for the listening sockets.
+	SocketProfile profile;
+} ServerOptions;
+
+/// @brief What a server does with new connections while its table is full.
+enum OverloadPolicy {
+	// Accept them, send the handler's overload response and close.
+	OVERLOAD_REFUSE,
+	// Accept and reset them.
+	OVERLOAD_RESET,
+	// Leave them in the listen queue until some connection closes. Once the
+	// table has been full, accepted connections are checked for how long
+	// they waited, and refused while that stays above OVERLOAD_DELAY_TARGET
+	// for OVERLOAD_DELAY_INTERVAL, like CoDel, so that those admitted are
+	// not served late.
+	OVERLOAD_QUEUE,
+};
+
+/// @brief Data received for a connection by the io_uring event loop, not yet
+///        taken by its reader. It is a list of provided buffers.
+typedef struct RecvInbox {
+	// IDs of the first and last buffer, -1 if empty.
+	int head;
+	int tail;
+	// Bytes of the first buffer already taken.
+	int offset;
+	bool is_eof;
+	// A multishot receive is active for the connection.
+	bool is_armed;
+	// The slot is in the list of those waiting for buffers to receive again,
+	// `next_stalled` is the slot after it. Kept even if the slot is reused.
+	bool is_stalled;
+	int next_stalled;
+} RecvInbox;
+
 /// @brief Connection information
 typedef struct Connection {
 	bool is_open;
 	int sock_fd;
-	time_t estb_time;
+	// Internal: Closes the connection when it expires, if active.
+	TimerNode timeout;
+	// Peer address. With io_uring it is only looked up for debug logs.
 	IPv4Address addr;
 	// Do not zero this out, while creating a new connection.
 	// Since, it holds the allocated data buffer.
 	CoroContext coro_ctx;
-	// Internal: Connection freelist, -1 means end of freelist.
-	// TODO implement this free list thing.
+	// Internal: Slot of the connection in the connection table.
+	int slot;
+	// Internal: Slot of the next free connection in the connection table's
+	// freelist, -1 means end of freelist.
 	int next_free;
+	// Internal: Incremented whenever the slot is used for a new connection,
+	// completions for an older one are then ignored.
+	uint32_t generation;
+	// Internal: Used by the io_uring backend only.
+	RecvInbox inbox;
 } Connection;
 
 typedef struct Server Server;
 typedef int (*ConnCallback)(CoroContext *, Connection *);
+typedef void (*ConnAbortCallback)(CoroContext *, Connection *);
+typedef void (*WorkerInitCallback)(Server *);
+typedef void (*FDCallback)(void *);
 
-/// @brief Allocates a server and binds it to the address.
-/// @param addr_ipv4
-/// @param port
+/// @brief How a server serves its connections.
+typedef struct ServerHandler {
+	// Coro-function run for every connection.
+	ConnCallback callback;
+	// Called when the server closes a connection before its coro completed,
+	// so that any resources held in the coro state can be released.
+	// The coro is not resumed afterwards. It can be NULL.
+	ConnAbortCallback abort;
+	// Amount of memory `callback` needs for storing its state.
+	size_t data_size;
+	// Called on the thread of each event loop before it starts serving,
+	// for setting up any per-loop state. It can be NULL.
+	WorkerInitCallback worker_init;
+	// What to do with new connections while the table is full.
+	enum OverloadPolicy overload;
+	// Sent to refused connections before closing them, it can be NULL.
+	const char *overload_response;
+	int overload_response_len;
+} ServerHandler;
+
+/// @brief Allocates a server and binds it to the addresses.
+/// @param o Options, `workers` is not used.
 /// @return Returns NULL on failure
-Server *server_create(IPv4Address addr);
+Server *server_create(const ServerOptions *o);
 
 /// @brief Start listening and serving requests.
 /// @param s The server created with server_create
-/// @param callback It must be a coro-function
-/// @param data_size Amount of memory `callback` needs for storing its state.
+/// @param handler Handler for connections, see ServerHandler.
 /// @return Retuns only on failure
-int server_listen(Server *s, ConnCallback callback, size_t data_size);
+int server_listen(Server *s, const ServerHandler *handler);
+
+/// @brief Runs multiple event loops, each on its own thread with its own
+///        server: listening socket, epoll instance and connection table.
+///        Listening sockets share their address using SO_REUSEPORT, so the
+///        kernel balances new connections among the workers.
+/// @param options Options, see ServerOptions.
+/// @param handler Handler for connections, shared by all workers.
+/// @return Returns only on failure
+int server_run_workers(const ServerOptions *options, const ServerHandler *handler);
+
+/// @brief Adds an FD to the event loop of the server, it is not a connection.
+///        The FD is watched for readability in level-triggered mode.
+/// @param s Server
+/// @param fd FD to watch
+/// @param callback Called with `data` when fd becomes readable.
+/// @param data Passed as-is to the callback.
+void server_watch_fd(Server *s, int fd, FDCallback callback, void *data);
+
+/// @brief Sets the time after which the server closes the connection,
+///        aborting its coro. It replaces any earlier deadline, it is O(1)
+///        and accurate to TIMER_TICK_MS.
+/// @param c Connection
+/// @param ms Time from now in milliseconds, 0 removes the deadline.
+void connection_set_timeout(Connection *c, int ms);
+
+/// @brief Returns a reader for the connection, it takes data received by the
+///        event loop if the backend receives on behalf of connections.
+BufReader connection_reader(Connection *c);
 
 /// @brief Closes the connection.
 /// @param c Connection pointer
@@ -0,0 +1,186 @@
+/**
+ * @file timer.c
+ * @brief Hierarchical timing wheel with cascading, as in the classic Linux
+ *        kernel timers.
+ */
+
+#include <assert.h>
+
+#include "common.h"
+#include "config.h"
+#include "server/timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+static uint64_t ms_to_tick(uint64_t ms)
+{
+	return (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+static void list_init(TimerNode *head) { head->prev = head->next = head; }
+
+static bool list_is_empty(const TimerNode *head) { return head->next == head; }
+
+void timer_wheel_init(TimerWheel *w, uint64_t now_ms)
+{
+	w->now = now_ms / TIMER_TICK_MS;
+	w->count = 0;
+	w->level0_bits = 0;
+
+	for (int l = 0; l < TIMER_LEVELS; ++l)
+		for (int i = 0; i < TIMER_SLOTS; ++i)
+			list_init(&w->slots[l][i]);
+}
+
+/// @brief Links a timer into the slot for its expiry, relative to now.
+static void place_timer(TimerWheel *w, TimerNode *t)
+{
+	uint64_t expires = t->expires < w->now ? w->now : t->expires;
+	uint64_t delta = expires - w->now;
+
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 &&
+	       delta >= (uint64_t)1 << (TIMER_SLOT_BITS * (level + 1)))
+		level++;
+	// Beyond the last level, it waits in the farthest slot and is placed
+	// again when that slot cascades.
+	if (delta >= (uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS))
+		expires = w->now + ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+
+	int slot = (expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+	TimerNode *head = &w->slots[level][slot];
+
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+
+	if (level == 0)
+		w->level0_bits |= (uint64_t)1 << slot;
+}
+
+static void unlink_timer(TimerWheel *w, TimerNode *t)
+{
+	TimerNode *next = t->next;
+	t->prev->next = next;
+	next->prev = t->prev;
+
+	// Clear the bit if this emptied a level 0 slot, its sentinel is then
+	// both neighbours.
+	uintptr_t first = (uintptr_t)&w->slots[0][0];
+	uintptr_t last = (uintptr_t)&w->slots[0][SLOT_MASK];
+	if (next == t->prev && (uintptr_t)next >= first &&
+	    (uintptr_t)next <= last)
+		w->level0_bits &= ~((uint64_t)1 << (next - &w->slots[0][0]));
+}
+
+void timer_start(TimerWheel *w, TimerNode *t, uint64_t expires_ms)
+{
+	if (t->is_active)
+		unlink_timer(w, t);
+	else
+		w->count++;
+
+	t->expires = ms_to_tick(expires_ms);
+	t->is_active = true;
+	place_timer(w, t);
+}
+
+void timer_stop(TimerWheel *w, TimerNode *t)
+{
+	if (!t->is_active)
+		return;
+
+	unlink_timer(w, t);
+	t->is_active = false;
+	w->count--;
+}
+
+/// @brief Moves timers of the current slot of a level to lower levels.
+static void cascade(TimerWheel *w, int level)
+{
+	int slot = (w->now >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+	if (slot == 0 && level + 1 < TIMER_LEVELS)
+		cascade(w, level + 1);
+
+	TimerNode *head = &w->slots[level][slot];
+	TimerNode pending;
+	if (list_is_empty(head))
+		return;
+
+	// Detach the list, then place every timer again.
+	pending.next = head->next;
+	pending.prev = head->prev;
+	pending.next->prev = pending.prev->next = &pending;
+	list_init(head);
+
+	while (!list_is_empty(&pending)) {
+		TimerNode *t = pending.next;
+		pending.next = t->next;
+		t->next->prev = &pending;
+		place_timer(w, t);
+	}
+}
+
+void timer_advance(
+	TimerWheel *w, uint64_t now_ms, TimerCallback expire, void *ctx
+)
+{
+	uint64_t target = now_ms / TIMER_TICK_MS;
+	if (w->now > target)
+		return;
+
+	while (w->now <= target) {
+		if (w->count == 0) {
+			w->now = target + 1;
+			break;
+		}
+
+		int slot = w->now & SLOT_MASK;
+		if (slot == 0)
+			cascade(w, 1);
+
+		// Nothing to expire until the next cascade. Skipping beyond the
+		// target would place timers started before then too late.
+		if (w->level0_bits == 0) {
+			uint64_t next = (w->now | SLOT_MASK) + 1;
+			w->now = next < target + 1 ? next : target + 1;
+			continue;
+		}
+
+		TimerNode *head = &w->slots[0][slot];
+		while (!list_is_empty(head)) {
+			TimerNode *t = head->next;
+			timer_stop(w, t);
+			expire(t, ctx);
+		}
+		w->now++;
+	}
+
+	assert(w->now == target + 1);
+}
+
+int timer_next_timeout(const TimerWheel *w, uint64_t now_ms)
+{
+	if (w->count == 0)
+		return -1;
+
+	// Timers of higher levels may be due soon after the next cascade, so
+	// the wheel must be advanced by then at the latest.
+	uint64_t next = (w->now | SLOT_MASK) + 1;
+	if (w->level0_bits != 0) {
+		// Rotate so that the current slot is bit 0.
+		int shift = w->now & SLOT_MASK;
+		uint64_t bits = w->level0_bits >> shift;
+		if (shift != 0)
+			bits |= w->level0_bits << (TIMER_SLOTS - shift);
+		uint64_t expiry = w->now + __builtin_ctzll(bits);
+		if (expiry < next)
+			next = expiry;
+	}
+
+	uint64_t next_ms = next * TIMER_TICK_MS;
+	if (next_ms <= now_ms)
+		return 0;
+	return next_ms - now_ms;
+}
@@ -0,0 +1,60 @@
+#ifndef TIMER_H_INCLUDED
+#define TIMER_H_INCLUDED
+
+#include <stdint.h>
+
+#include "common.h"
+
+/// @brief Hierarchical timing wheel, adding and removing a timer is O(1).
+///        Time is counted in ticks of TIMER_TICK_MS. Each level has 64
+///        slots, a slot of level L spans 64^L ticks. Timers move to lower
+///        levels as their time comes closer, and expire from level 0.
+///        A wheel is used by a single event loop only.
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+/// @brief A timer, embedded in the object it is for.
+typedef struct TimerNode {
+	struct TimerNode *prev;
+	struct TimerNode *next;
+	// Tick at which it expires.
+	uint64_t expires;
+	bool is_active;
+} TimerNode;
+
+typedef struct TimerWheel {
+	// Ticks before it have been processed.
+	uint64_t now;
+	int count;
+	// Bit i is set if slot i of level 0 has timers.
+	uint64_t level0_bits;
+	// Slot lists are circular, with the slot as the sentinel node.
+	TimerNode slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+typedef void (*TimerCallback)(TimerNode *t, void *ctx);
+
+/// @brief Initializes an empty wheel.
+/// @param now_ms Current time in milliseconds.
+void timer_wheel_init(TimerWheel *w, uint64_t now_ms);
+
+/// @brief Starts a timer, restarting it if it is active.
+/// @param expires_ms Time at which it expires, it is rounded up to a tick.
+void timer_start(TimerWheel *w, TimerNode *t, uint64_t expires_ms);
+
+/// @brief Stops a timer, it does nothing if the timer is not active.
+void timer_stop(TimerWheel *w, TimerNode *t);
+
+/// @brief Expires all timers due by now, calling `expire` for each of them.
+///        Timers are stopped before their callback is called.
+void timer_advance(
+	TimerWheel *w, uint64_t now_ms, TimerCallback expire, void *ctx
+);
+
+/// @brief Returns milliseconds until the wheel needs to be advanced next,
+///        -1 if it has no timers. Suitable as an epoll_wait timeout.
+int timer_next_timeout(const TimerWheel *w, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,361 @@
+/**
+ * @file settings.c
+ * @brief Reading settings from config files and command-line values.
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config.h"
+#include "logger.h"
+#include "settings.h"
+
+enum SettingType {
+	// An int within [min, max].
+	SETTING_NUMBER,
+	SETTING_BOOL,
+	// Comma separated list of a.b.c.d:port.
+	SETTING_ADDRESSES,
+	SETTING_BACKEND,
+	SETTING_OVERLOAD,
+	SETTING_PATH,
+};
+
+#define FIELD(member) offsetof(Settings, member)
+
+static const struct {
+	const char *key;
+	enum SettingType type;
+	size_t offset;
+	long min;
+	long max;
+	const char *help;
+} SETTINGS[] = {
+	{"listen", SETTING_ADDRESSES, FIELD(server), 0, 0,
+	 "Addresses to listen on as a.b.c.d:port,..."},
+	{"workers", SETTING_NUMBER, FIELD(server.workers), 1, WORKERS_MAX,
+	 "Number of worker threads."},
+	{"connections", SETTING_NUMBER, FIELD(server.connections_max), 1,
+	 INT32_MAX / 2, "Max connections per worker."},
+	{"events", SETTING_NUMBER, FIELD(server.events_max), 1, 1 << 16,
+	 "Max events handled per epoll wakeup."},
+	{"backend", SETTING_BACKEND, FIELD(server.backend), 0, 0,
+	 "Event backend: epoll or io_uring."},
+	{"overload", SETTING_OVERLOAD, FIELD(overload), 0, 0,
+	 "When all connections are in use: refuse, reset or queue."},
+	{"backlog", SETTING_NUMBER, FIELD(server.profile.backlog), 0, INT32_MAX,
+	 "Length of the listen queue."},
+	{"defer", SETTING_NUMBER, FIELD(server.profile.defer_accept), 0,
+	 INT32_MAX, "Seconds to wait for data before accepting, 0 is off."},
+	{"fastopen", SETTING_NUMBER, FIELD(server.profile.fastopen), 0, INT32_MAX,
+	 "Length of the TCP Fast Open queue, 0 is off."},
+	{"nodelay", SETTING_BOOL, FIELD(server.profile.nodelay), 0, 0,
+	 "Disable Nagle's algorithm."},
+	{"sndbuf", SETTING_NUMBER, FIELD(server.profile.sndbuf), 0, INT32_MAX,
+	 "Socket send buffer size, 0 is the system default."},
+	{"rcvbuf", SETTING_NUMBER, FIELD(server.profile.rcvbuf), 0, INT32_MAX,
+	 "Socket receive buffer size, 0 is the system default."},
+	{"buffer_size", SETTING_NUMBER, FIELD(buffer_size), 64, 1 << 24,
+	 "Size of the smallest pooled buffer."},
+	{"header_size", SETTING_NUMBER, FIELD(header_size_max), 1024, 1 << 20,
+	 "Max size of request and response headers."},
+	{"keepalive_requests", SETTING_NUMBER, FIELD(keepalive_requests_max), 1,
+	 INT32_MAX, "Max requests per persistent connection."},
+	{"header_timeout", SETTING_NUMBER, FIELD(header_timeout), 0,
+	 INT32_MAX / 1000, "Seconds to receive a request header, 0 is off."},
+	{"keepalive_timeout", SETTING_NUMBER, FIELD(keepalive_timeout), 0,
+	 INT32_MAX / 1000, "Seconds to wait for the next request, 0 is off."},
+	{"write_timeout", SETTING_NUMBER, FIELD(write_timeout), 0,
+	 INT32_MAX / 1000, "Seconds a response can be stalled, 0 is off."},
+	{"file_cache", SETTING_NUMBER, FIELD(file_cache_max), 1, 1 << 24,
+	 "Open-file cache entries per worker."},
+	{"hot_cache", SETTING_NUMBER, FIELD(hot_cache_budget), 0, INT32_MAX,
+	 "Bytes of file contents kept in memory per worker."},
+	{"hot_file_size", SETTING_NUMBER, FIELD(hot_file_size_max), 0, INT32_MAX,
+	 "Largest file kept in memory."},
+	{"root", SETTING_PATH, FIELD(root), 0, 0,
+	 "Directory to serve files from."},
+	{"log", SETTING_PATH, FIELD(log_path), 0, 0,
+	 "File to append logs to, empty for stderr."},
+};
+
+#undef FIELD
+
+#define SETTINGS_CNT ((int)(sizeof SETTINGS / sizeof SETTINGS[0]))
+
+// Reason the last value was rejected.
+static char reason[256];
+
+void settings_init(Settings *s)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	*s = (Settings){
+		.server = {
+			.listen = {{127, 0, 0, 1, 5000}},
+			.listen_cnt = 1,
+			.workers = cpus < 1 ? 1 : cpus > WORKERS_MAX ? WORKERS_MAX : cpus,
+			.connections_max = CONNECTIONS_MAX,
+			.events_max = EVENTS_MAX,
+			.backend = BACKEND_EPOLL,
+			.profile = SOCKET_PROFILE_DEFAULT,
+		},
+		.overload = OVERLOAD_REFUSE,
+		.buffer_size = BUFFER_SIZE,
+		.header_size_max = HEADER_SIZE_MAX,
+		.keepalive_requests_max = KEEPALIVE_REQUESTS_MAX,
+		.header_timeout = HEADER_TIMEOUT,
+		.keepalive_timeout = KEEPALIVE_TIMEOUT,
+		.write_timeout = WRITE_TIMEOUT,
+		.file_cache_max = FILE_CACHE_MAX,
+		.hot_cache_budget = HOT_CACHE_BUDGET,
+		.hot_file_size_max = HOT_FILE_SIZE_MAX,
+		.root = ".",
+		.log_path = "",
+	};
+}
+
+/// @brief Parses a decimal number, optionally ending in k, m or g.
+static bool parse_number(const char *text, long *n)
+{
+	char *end = NULL;
+	errno = 0;
+	long value = strtol(text, &end, 10);
+	if (end == text || errno == ERANGE)
+		return false;
+
+	int shift = 0;
+	switch (tolower((unsigned char)*end)) {
+	case 'k':
+		shift = 10;
+		break;
+	case 'm':
+		shift = 20;
+		break;
+	case 'g':
+		shift = 30;
+		break;
+	}
+	if (shift > 0)
+		end++;
+	if (*end != '\0' || value < 0 || value > (INT32_MAX >> shift))
+		return false;
+
+	*n = value << shift;
+	return true;
+}
+
+static bool parse_bool(const char *text, bool *b)
+{
+	static const char *const TRUE[] = {"1", "yes", "on", "true"};
+	static const char *const FALSE[] = {"0", "no", "off", "false"};
+
+	for (size_t i = 0; i < sizeof TRUE / sizeof TRUE[0]; ++i) {
+		if (!strcasecmp(text, TRUE[i])) {
+			*b = true;
+			return true;
+		}
+		if (!strcasecmp(text, FALSE[i])) {
+			*b = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+/// @brief Parses a.b.c.d:port
+static bool parse_address(char *text, IPv4Address *addr)
+{
+	char *colon = strrchr(text, ':');
+	if (colon == NULL)
+		return false;
+	*colon = '\0';
+
+	struct in_addr in;
+	char *end = NULL;
+	long port = strtol(colon + 1, &end, 10);
+	if (inet_pton(AF_INET, text, &in) != 1 || end == colon + 1 ||
+	    *end != '\0' || port < 0 || port > UINT16_MAX)
+		return false;
+
+	uint8_t *bytes = (uint8_t *)&in.s_addr;
+	*addr = (IPv4Address){bytes[0], bytes[1], bytes[2], bytes[3], port};
+	return true;
+}
+
+/// @brief Removes leading and trailing whitespace in place.
+static char *trim(char *text)
+{
+	while (isspace((unsigned char)*text))
+		text++;
+	char *end = text + strlen(text);
+	while (end > text && isspace((unsigned char)end[-1]))
+		end--;
+	*end = '\0';
+	return text;
+}
+
+/// @brief Parses a list of addresses into the options, replacing those set
+///        before.
+static bool parse_addresses(const char *text, ServerOptions *o)
+{
+	char list[1024];
+	if (snprintf(list, sizeof list, "%s", text) >= (int)sizeof list) {
+		snprintf(reason, sizeof reason, "too long");
+		return false;
+	}
+
+	IPv4Address addrs[LISTENERS_MAX];
+	int cnt = 0;
+	char *save = NULL;
+	for (char *item = strtok_r(list, ",", &save); item != NULL;
+	     item = strtok_r(NULL, ",", &save)) {
+		item = trim(item);
+		if (cnt == LISTENERS_MAX) {
+			snprintf(reason, sizeof reason, "at most %d allowed", LISTENERS_MAX);
+			return false;
+		}
+		if (!parse_address(item, &addrs[cnt++])) {
+			snprintf(reason, sizeof reason, "expected a.b.c.d:port");
+			return false;
+		}
+	}
+	if (cnt == 0) {
+		snprintf(reason, sizeof reason, "no address given");
+		return false;
+	}
+
+	memcpy(o->listen, addrs, sizeof addrs[0] * cnt);
+	o->listen_cnt = cnt;
+	return true;
+}
+
+/// @brief Sets a setting, `reason` tells why on failure.
+static bool apply(Settings *s, const char *key, const char *value)
+{
+	int i = 0;
+	while (i < SETTINGS_CNT && strcmp(SETTINGS[i].key, key))
+		++i;
+	if (i == SETTINGS_CNT) {
+		snprintf(reason, sizeof reason, "unknown setting");
+		return false;
+	}
+
+	void *field = (char *)s + SETTINGS[i].offset;
+	long n = 0;
+
+	switch (SETTINGS[i].type) {
+	case SETTING_NUMBER:
+		if (!parse_number(value, &n) || n < SETTINGS[i].min ||
+		    n > SETTINGS[i].max) {
+			snprintf(
+				reason, sizeof reason, "expected a number in range [%ld, %ld]",
+				SETTINGS[i].min, SETTINGS[i].max
+			);
+			return false;
+		}
+		*(int *)field = n;
+		return true;
+	case SETTING_BOOL:
+		if (!parse_bool(value, field)) {
+			snprintf(reason, sizeof reason, "expected 0 or 1");
+			return false;
+		}
+		return true;
+	case SETTING_ADDRESSES:
+		return parse_addresses(value, field);
+	case SETTING_BACKEND:
+		if (!strcmp(value, "epoll")) {
+			s->server.backend = BACKEND_EPOLL;
+		} else if (!strcmp(value, "io_uring")) {
+			s->server.backend = BACKEND_IO_URING;
+		} else {
+			snprintf(reason, sizeof reason, "expected epoll or io_uring");
+			return false;
+		}
+		return true;
+	case SETTING_OVERLOAD:
+		if (!strcmp(value, "refuse")) {
+			s->overload = OVERLOAD_REFUSE;
+		} else if (!strcmp(value, "reset")) {
+			s->overload = OVERLOAD_RESET;
+		} else if (!strcmp(value, "queue")) {
+			s->overload = OVERLOAD_QUEUE;
+		} else {
+			snprintf(reason, sizeof reason, "expected refuse, reset or queue");
+			return false;
+		}
+		return true;
+	case SETTING_PATH:
+		if (snprintf(field, PATH_MAX, "%s", value) >= PATH_MAX) {
+			snprintf(reason, sizeof reason, "path is too long");
+			return false;
+		}
+		return true;
+	}
+	return false;
+}
+
+bool settings_set(Settings *s, const char *key, const char *value)
+{
+	if (!apply(s, key, value)) {
+		LOG_FATAL("Invalid setting %s = %s: %s", key, value, reason);
+		return false;
+	}
+	return true;
+}
+
+bool settings_load(Settings *s, const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		LOG_FATAL("Cannot open config file %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	char *line = NULL;
+	size_t cap = 0;
+	bool is_valid = true;
+	for (int n = 1; is_valid && getline(&line, &cap, file) >= 0; ++n) {
+		char *key = trim(line);
+		if (*key == '\0' || *key == '#')
+			continue;
+
+		char *value = strchr(key, '=');
+		if (value == NULL) {
+			LOG_FATAL("%s:%d: expected key = value", path, n);
+			is_valid = false;
+			continue;
+		}
+		*value++ = '\0';
+		key = trim(key);
+		value = trim(value);
+
+		if (!apply(s, key, value)) {
+			LOG_FATAL("%s:%d: %s: %s", path, n, key, reason);
+			is_valid = false;
+		}
+	}
+	if (is_valid && ferror(file)) {
+		LOG_FATAL("Cannot read config file %s: %s", path, strerror(errno));
+		is_valid = false;
+	}
+
+	free(line);
+	fclose(file);
+	return is_valid;
+}
+
+void settings_print_keys(void)
+{
+	for (int i = 0; i < SETTINGS_CNT; ++i)
+		PRINTE("  %-20s %s\n", SETTINGS[i].key, SETTINGS[i].help);
+}
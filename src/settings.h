@@ -0,0 +1,67 @@
+#ifndef SETTINGS_H_INCLUDED
+#define SETTINGS_H_INCLUDED
+
+#include <limits.h>
+#include <stdbool.h>
+
+#include "server/server.h"
+
+/* Settings are read at startup from a config file and the command line,
+ * both set them by key, see settings_set. Defaults come from config.h, so
+ * limits can be tuned for a deployment without rebuilding.
+ *
+ * A config file has one "key = value" per line, blank lines and lines
+ * starting with '#' are skipped, e.g.:
+ *   listen = 0.0.0.0:80, 0.0.0.0:8080
+ *   workers = 8
+ *   hot_cache = 256m
+ */
+
+typedef struct Settings {
+	// Listen addresses, workers, connection table and socket options.
+	ServerOptions server;
+	enum OverloadPolicy overload;
+	// Size of the smallest pooled buffer, see bufpool_set_size.
+	int buffer_size;
+	// Max size of request and response headers.
+	int header_size_max;
+	// Max number of requests served over a persistent connection.
+	int keepalive_requests_max;
+	// Timeouts in seconds, 0 disables one. See HTTPConfig.
+	int header_timeout;
+	int keepalive_timeout;
+	int write_timeout;
+	// Per worker: entries of the open-file cache, bytes of the in-memory
+	// cache and the largest file it keeps.
+	int file_cache_max;
+	int hot_cache_budget;
+	int hot_file_size_max;
+	// Directory to serve files from.
+	char root[PATH_MAX];
+	// File to append logs to, empty for stderr.
+	char log_path[PATH_MAX];
+} Settings;
+
+/// @brief Fills in the defaults.
+void settings_init(Settings *s);
+
+/// @brief Sets a setting from its text value. Numbers may end in k, m or g
+///        to multiply them by 2^10, 2^20 or 2^30.
+/// @param s Settings
+/// @param key Name of the setting, see settings_print_keys.
+/// @param value Its value.
+/// @return false if the key is unknown or the value is invalid, the reason
+///         is logged.
+bool settings_set(Settings *s, const char *key, const char *value);
+
+/// @brief Sets all settings given in a config file.
+/// @param s Settings
+/// @param path Path of the config file.
+/// @return false if it cannot be read or any line is invalid, the reason is
+///         logged with the line number.
+bool settings_load(Settings *s, const char *path);
+
+/// @brief Prints the keys of all settings with their descriptions.
+void settings_print_keys(void);
+
+#endif
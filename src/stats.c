@@ -0,0 +1,248 @@
+/**
+ * @file stats.c
+ * @brief Registering per-thread stats and formatting their merged values.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "common.h"
+#include "config.h"
+#include "logger.h"
+#include "memory.h"
+#include "stats.h"
+
+_Thread_local Stats *local_stats = NULL;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static Stats *thread_stats[WORKERS_MAX];
+static _Atomic int stats_cnt = 0;
+
+static const struct {
+	const char *name;
+	const char *help;
+	bool is_gauge;
+} COUNTER_INFO[STAT_COUNTER_COUNT] = {
+	[STAT_ACCEPTED] = {"connections_accepted", "Connections accepted."},
+	[STAT_OVERLOAD_REFUSED] = {"overload_refused",
+	                           "Connections refused while the table was full."},
+	[STAT_OVERLOAD_RESET] = {"overload_reset",
+	                         "Connections reset while the table was full."},
+	[STAT_OVERLOAD_DROPPED] = {"overload_dropped",
+	                           "Connections refused for their queue delay."},
+	[STAT_OVERLOAD_PAUSED] = {"overload_paused",
+	                          "Times accepting paused for a full table."},
+	[STAT_TIMED_OUT] = {"connections_timed_out",
+	                    "Connections closed since their deadline passed."},
+	[STAT_ACTIVE] = {"connections_active", "Connections open.", true},
+	[STAT_REQUESTS] = {"requests", "Requests served."},
+	[STAT_BYTES_SENT] = {"bytes_sent", "Bytes written to connections."},
+	[STAT_READ_BLOCKED] = {"reads_blocked", "Reads which returned EAGAIN."},
+	[STAT_WRITE_BLOCKED] = {"writes_blocked", "Writes which returned EAGAIN."},
+	[STAT_HOT_HITS] = {"hot_cache_hits", "Files served from memory."},
+	[STAT_HOT_MISSES] = {"hot_cache_misses",
+	                     "Small files not found in memory."},
+	[STAT_HOT_EVICTIONS] = {"hot_cache_evictions",
+	                        "Files dropped from memory for the budget."},
+	[STAT_HOT_BYTES] = {"hot_cache_bytes", "Bytes of files in memory.", true},
+	[STAT_LATENCY_SUM] = {"latency_sum_us", "Sum of request latencies."},
+};
+
+// Percentiles reported for the latency histogram.
+static const double PERCENTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+/// @brief Merged values of all threads.
+typedef struct StatsTotal {
+	uint64_t counters[STAT_COUNTER_COUNT];
+	uint64_t statuses[STATS_STATUS_MAX];
+	uint64_t latency[LATENCY_BUCKETS];
+} StatsTotal;
+
+Stats *stats_register(void)
+{
+	pthread_mutex_lock(&stats_lock);
+	int cnt = atomic_load_explicit(&stats_cnt, memory_order_relaxed);
+	if (cnt == WORKERS_MAX) {
+		LOG_FATAL("Cannot keep stats for more than %d threads", WORKERS_MAX);
+		abort();
+	}
+
+	local_stats = ALLOCATE(Stats);
+	if (local_stats == NULL)
+		ERRNO_FATAL("calloc");
+	thread_stats[cnt] = local_stats;
+	atomic_store_explicit(&stats_cnt, cnt + 1, memory_order_release);
+	pthread_mutex_unlock(&stats_lock);
+
+	return local_stats;
+}
+
+uint64_t stats_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void merge_stats(StatsTotal *t)
+{
+	int cnt = atomic_load_explicit(&stats_cnt, memory_order_acquire);
+
+	for (int i = 0; i < cnt; ++i) {
+		Stats *s = thread_stats[i];
+		for (int j = 0; j < STAT_COUNTER_COUNT; ++j)
+			t->counters[j] += atomic_load_explicit(
+				&s->counters[j], memory_order_relaxed
+			);
+		for (int j = 0; j < STATS_STATUS_MAX; ++j)
+			t->statuses[j] += atomic_load_explicit(
+				&s->statuses[j], memory_order_relaxed
+			);
+		for (int j = 0; j < LATENCY_BUCKETS; ++j)
+			t->latency[j] += atomic_load_explicit(
+				&s->latency[j], memory_order_relaxed
+			);
+	}
+}
+
+/// @brief Returns the highest value which falls in the bucket.
+static uint64_t bucket_max_value(int bucket)
+{
+	int group = bucket / LATENCY_SUB_BUCKETS;
+	if (group == 0)
+		return bucket;
+
+	uint64_t sub = LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS;
+	return ((sub + 1) << (group - 1)) - 1;
+}
+
+/// @brief Returns the value at or below which `fraction` of values lie.
+static uint64_t histogram_percentile(const uint64_t *buckets, double fraction)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; ++i)
+		total += buckets[i];
+	if (total == 0)
+		return 0;
+
+	uint64_t rank = fraction * total;
+	if (rank == 0)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+		seen += buckets[i];
+		if (seen >= rank)
+			return bucket_max_value(i);
+	}
+	return bucket_max_value(LATENCY_BUCKETS - 1);
+}
+
+/// @brief Appends formatted text, a printf for StringBuilder.
+__attribute__((format(printf, 2, 3))) static bool
+append_format(StringBuilder *out, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(out->data + out->len, out->cap - out->len, fmt, args);
+	va_end(args);
+
+	if (len < 0 || len >= out->cap - out->len)
+		return false;
+	out->len += len;
+	return true;
+}
+
+static bool format_plain(StringBuilder *out, const StatsTotal *t)
+{
+	bool ok = true;
+
+	for (int i = 0; i < STAT_COUNTER_COUNT; ++i)
+		ok = ok && append_format(
+			out, "%s %lu\n", COUNTER_INFO[i].name,
+			(unsigned long)t->counters[i]
+		);
+
+	for (int i = 0; i < STATS_STATUS_MAX; ++i) {
+		if (t->statuses[i] != 0)
+			ok = ok && append_format(
+				out, "status_%d %lu\n", i, (unsigned long)t->statuses[i]
+			);
+	}
+
+	for (size_t i = 0; i < sizeof PERCENTILES / sizeof PERCENTILES[0]; ++i)
+		ok = ok && append_format(
+			out, "latency_p%g_us %lu\n", PERCENTILES[i] * 100,
+			(unsigned long)histogram_percentile(t->latency, PERCENTILES[i])
+		);
+
+	return ok;
+}
+
+static bool format_prometheus(StringBuilder *out, const StatsTotal *t)
+{
+	bool ok = true;
+
+	for (int i = 0; i < STAT_COUNTER_COUNT; ++i) {
+		if (i == STAT_LATENCY_SUM)
+			continue; // Part of the latency summary.
+
+		bool gauge = COUNTER_INFO[i].is_gauge;
+		const char *name = COUNTER_INFO[i].name;
+		ok = ok && append_format(
+			out, "# HELP cnsync_%s%s %s\n# TYPE cnsync_%s%s %s\ncnsync_%s%s %lu\n",
+			name, gauge ? "" : "_total", COUNTER_INFO[i].help, name,
+			gauge ? "" : "_total", gauge ? "gauge" : "counter", name,
+			gauge ? "" : "_total", (unsigned long)t->counters[i]
+		);
+	}
+
+	ok = ok && append_format(
+		out, "# HELP cnsync_responses_total Responses by status code.\n"
+		     "# TYPE cnsync_responses_total counter\n"
+	);
+	for (int i = 0; i < STATS_STATUS_MAX; ++i) {
+		if (t->statuses[i] != 0)
+			ok = ok && append_format(
+				out, "cnsync_responses_total{code=\"%d\"} %lu\n", i,
+				(unsigned long)t->statuses[i]
+			);
+	}
+
+	ok = ok && append_format(
+		out, "# HELP cnsync_request_duration_seconds Time from the first "
+		     "byte of a request to writing its response.\n"
+		     "# TYPE cnsync_request_duration_seconds summary\n"
+	);
+	for (size_t i = 0; i < sizeof PERCENTILES / sizeof PERCENTILES[0]; ++i)
+		ok = ok && append_format(
+			out, "cnsync_request_duration_seconds{quantile=\"%g\"} %.6f\n",
+			PERCENTILES[i],
+			histogram_percentile(t->latency, PERCENTILES[i]) / 1e6
+		);
+	ok = ok && append_format(
+		out,
+		"cnsync_request_duration_seconds_sum %.6f\n"
+		"cnsync_request_duration_seconds_count %lu\n",
+		t->counters[STAT_LATENCY_SUM] / 1e6,
+		(unsigned long)t->counters[STAT_REQUESTS]
+	);
+
+	return ok;
+}
+
+bool stats_format(StringBuilder *out, bool prometheus)
+{
+	// Too large for the stack of an event loop.
+	StatsTotal *t = ALLOCATE(StatsTotal);
+	if (t == NULL)
+		ERRNO_FATAL("calloc");
+
+	merge_stats(t);
+	bool ok = prometheus ? format_prometheus(out, t) : format_plain(out, t);
+
+	FREE(t);
+	return ok;
+}
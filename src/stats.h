@@ -0,0 +1,128 @@
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "mystr.h"
+
+/* Operational counters, each thread updates its own set without locks or
+ * atomic read-modify-write instructions. Reading them sums up the sets of
+ * all threads, values are only eventually consistent with each other.
+ */
+
+enum StatCounter {
+	// Connections accepted.
+	STAT_ACCEPTED,
+	// Connections refused with the overload response, reset, or refused
+	// for waiting too long in the listen queue, see OverloadPolicy.
+	STAT_OVERLOAD_REFUSED,
+	STAT_OVERLOAD_RESET,
+	STAT_OVERLOAD_DROPPED,
+	// Times accepting was paused since the connection table was full.
+	STAT_OVERLOAD_PAUSED,
+	// Connections closed since their deadline passed.
+	STAT_TIMED_OUT,
+	// Connections currently open, it is a gauge.
+	STAT_ACTIVE,
+	STAT_REQUESTS,
+	// Bytes of responses written to sockets.
+	STAT_BYTES_SENT,
+	// Reads and writes which found the socket not ready, EAGAIN.
+	STAT_READ_BLOCKED,
+	STAT_WRITE_BLOCKED,
+	// Lookups of the in-memory cache of small files, files it dropped to
+	// stay within its budget, and bytes it holds as a gauge, see HotCache.
+	STAT_HOT_HITS,
+	STAT_HOT_MISSES,
+	STAT_HOT_EVICTIONS,
+	STAT_HOT_BYTES,
+	// Sum of request latencies in microseconds.
+	STAT_LATENCY_SUM,
+	STAT_COUNTER_COUNT,
+};
+
+// Response status codes counted individually, others count as 0.
+#define STATS_STATUS_MAX 600
+
+// Latency histogram in microseconds with log-linear buckets: each power of
+// 2 range is split into 2^LATENCY_SUB_BITS buckets, so a value is off by
+// at most 1/16th. Values beyond 2^(LATENCY_EXP_MAX + 1) go to the last one.
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_EXP_MAX 31
+#define LATENCY_BUCKETS \
+	((LATENCY_EXP_MAX - LATENCY_SUB_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+typedef struct Stats {
+	_Atomic uint64_t counters[STAT_COUNTER_COUNT];
+	_Atomic uint64_t statuses[STATS_STATUS_MAX];
+	_Atomic uint64_t latency[LATENCY_BUCKETS];
+} Stats;
+
+/// @brief Stats of the calling thread, see stats_local.
+extern _Thread_local Stats *local_stats;
+
+/// @brief Allocates the stats of the calling thread and adds them to those
+///        merged by readers.
+Stats *stats_register(void);
+
+static inline Stats *stats_local(void)
+{
+	return local_stats != NULL ? local_stats : stats_register();
+}
+
+// Only the owning thread writes, so a plain load and store is enough.
+static inline void stats_bump(_Atomic uint64_t *c, uint64_t n)
+{
+	uint64_t v = atomic_load_explicit(c, memory_order_relaxed);
+	atomic_store_explicit(c, v + n, memory_order_relaxed);
+}
+
+static inline void stats_add(enum StatCounter c, uint64_t n)
+{
+	stats_bump(&stats_local()->counters[c], n);
+}
+
+static inline void stats_set(enum StatCounter c, uint64_t value)
+{
+	atomic_store_explicit(&stats_local()->counters[c], value, memory_order_relaxed);
+}
+
+static inline int latency_bucket(uint64_t us)
+{
+	if (us < LATENCY_SUB_BUCKETS)
+		return us;
+
+	int exp = 63 - __builtin_clzll(us);
+	if (exp > LATENCY_EXP_MAX)
+		return LATENCY_BUCKETS - 1;
+
+	return (exp - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+	       (us >> (exp - LATENCY_SUB_BITS)) - LATENCY_SUB_BUCKETS;
+}
+
+/// @brief Counts a served request.
+/// @param status Status code of its response.
+/// @param latency_us Time from its first byte to writing its response.
+static inline void stats_count_request(int status, uint64_t latency_us)
+{
+	Stats *s = stats_local();
+	stats_bump(&s->counters[STAT_REQUESTS], 1);
+	stats_bump(&s->counters[STAT_LATENCY_SUM], latency_us);
+	stats_bump(&s->statuses[status < STATS_STATUS_MAX ? status : 0], 1);
+	stats_bump(&s->latency[latency_bucket(latency_us)], 1);
+}
+
+/// @brief Returns CLOCK_MONOTONIC time in microseconds, for latencies.
+uint64_t stats_time_us(void);
+
+/// @brief Writes the merged stats of all threads.
+/// @param out Text is appended to it, as much as fits.
+/// @param prometheus Use Prometheus text exposition format, instead of
+///        plain "name value" lines.
+/// @return false if it did not fit.
+bool stats_format(StringBuilder *out, bool prometheus);
+
+#endif
@@ -0,0 +1,223 @@
+/**
+ * @file trace.c
+ * @brief Per-thread rings of request phase timings, dumped on a signal.
+ *
+ * Each ring is written only by its own thread, it overwrites the oldest
+ * records when full. Any thread can read a ring while it is being written:
+ * it copies the records and then discards those which the writer may have
+ * overwritten meanwhile, as told by the head position read after copying.
+ * Dump signals are blocked in all threads but taken by a dedicated thread
+ * with sigwaitinfo, which writes the dump so that event loops never wait
+ * for the file.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config.h"
+#include "logger.h"
+#include "memory.h"
+#include "trace.h"
+
+typedef struct TraceRing {
+	// Number of records ever written, the next one goes at head.
+	_Atomic uint64_t head;
+	uint8_t thread;
+	TraceRecord records[TRACE_RING_SIZE];
+} TraceRing;
+
+// Name and Chrome trace event type of each phase. Spans are async events
+// with the connection as their id, so they nest: request within connection.
+static const struct {
+	const char *name;
+	char type;
+} PHASE_INFO[TRACE_PHASE_COUNT] = {
+	[TRACE_ACCEPT] = {"connection", 'b'},
+	[TRACE_WAKE] = {"wake", 'n'},
+	[TRACE_FIRST_BYTE] = {"request", 'b'},
+	[TRACE_HEADER_PARSED] = {"header parsed", 'n'},
+	[TRACE_HEADER_WRITTEN] = {"header written", 'n'},
+	[TRACE_DRAINED] = {"request", 'e'},
+	[TRACE_CLOSE] = {"connection", 'e'},
+};
+
+static const char BINARY_MAGIC[8] = "CNTRACE1";
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing *rings[WORKERS_MAX];
+static _Atomic int ring_cnt = 0;
+
+static _Thread_local TraceRing *thread_ring = NULL;
+static _Thread_local uint32_t current_conn = 0;
+
+static TraceRing *get_thread_ring(void)
+{
+	if (thread_ring != NULL)
+		return thread_ring;
+
+	pthread_mutex_lock(&rings_lock);
+	int cnt = atomic_load_explicit(&ring_cnt, memory_order_relaxed);
+	if (cnt == WORKERS_MAX) {
+		LOG_FATAL("Cannot trace more than %d threads", WORKERS_MAX);
+		abort();
+	}
+
+	thread_ring = ALLOCATE(TraceRing);
+	if (thread_ring == NULL)
+		ERRNO_FATAL("calloc");
+	thread_ring->thread = cnt;
+	rings[cnt] = thread_ring;
+	atomic_store_explicit(&ring_cnt, cnt + 1, memory_order_release);
+	pthread_mutex_unlock(&rings_lock);
+
+	return thread_ring;
+}
+
+void trace_set_conn(uint32_t conn) { current_conn = conn; }
+
+void trace_record(enum TracePhase phase)
+{
+	TraceRing *r = get_thread_ring();
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	r->records[head & (TRACE_RING_SIZE - 1)] = (TraceRecord){
+		.time_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec,
+		.conn = current_conn,
+		.phase = phase,
+		.thread = r->thread,
+	};
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/// @brief Copies the records of a ring which are intact.
+/// @param out Space for TRACE_RING_SIZE records.
+/// @return Number of records copied, oldest first.
+static int snapshot_ring(TraceRing *r, TraceRecord *out)
+{
+	uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	uint64_t start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+	for (uint64_t i = start; i < head; ++i)
+		out[i - start] = r->records[i & (TRACE_RING_SIZE - 1)];
+
+	// Records at and after `head - TRACE_RING_SIZE` may have been
+	// overwritten, the one at the current head may be half written.
+	atomic_thread_fence(memory_order_acquire);
+	uint64_t now = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint64_t valid = now >= TRACE_RING_SIZE ? now - TRACE_RING_SIZE + 1 : 0;
+	if (valid <= start)
+		return head - start;
+	if (valid >= head)
+		return 0;
+
+	memmove(out, out + (valid - start), (head - valid) * sizeof *out);
+	return head - valid;
+}
+
+static void write_json_record(FILE *f, const TraceRecord *rec, bool is_first)
+{
+	uint64_t id = (uint64_t)rec->thread << 32 | rec->conn;
+
+	fprintf(
+		f,
+		"%s{\"name\":\"%s\",\"cat\":\"conn\",\"ph\":\"%c\",\"id\":\"0x%" PRIx64
+		"\",\"ts\":%" PRIu64 ".%03u,\"pid\":%d,\"tid\":%u}",
+		is_first ? "" : ",\n", PHASE_INFO[rec->phase].name,
+		PHASE_INFO[rec->phase].type, id, rec->time_ns / 1000,
+		(unsigned)(rec->time_ns % 1000), (int)getpid(), rec->thread
+	);
+}
+
+/// @brief Writes all rings to a file, as JSON or binary.
+static void dump_traces(bool is_json)
+{
+	char path[64];
+	snprintf(
+		path, sizeof path, "cnsync-trace-%d.%s", (int)getpid(),
+		is_json ? "json" : "bin"
+	);
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		LOG_ERROR("Cannot dump traces to %s: %s", path, strerror(errno));
+		return;
+	}
+
+	TraceRecord *records = ALLOCATE_ARRAY(TraceRecord, TRACE_RING_SIZE);
+	if (records == NULL)
+		ERRNO_FATAL("calloc");
+
+	if (is_json) {
+		fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", f);
+	} else {
+		uint32_t header[2] = {sizeof(TraceRecord), 0};
+		fwrite(BINARY_MAGIC, sizeof BINARY_MAGIC, 1, f);
+		fwrite(header, sizeof header, 1, f);
+	}
+
+	int total = 0;
+	int cnt = atomic_load_explicit(&ring_cnt, memory_order_acquire);
+	for (int i = 0; i < cnt; ++i) {
+		int n = snapshot_ring(rings[i], records);
+		if (!is_json)
+			fwrite(records, sizeof(TraceRecord), n, f);
+		for (int j = 0; is_json && j < n; ++j)
+			write_json_record(f, &records[j], total + j == 0);
+		total += n;
+	}
+
+	if (is_json)
+		fputs("\n]}\n", f);
+	fclose(f);
+	FREE(records);
+
+	LOG_INFO("Dumped %d trace records to %s", total, path);
+}
+
+/// @brief Waits for dump signals and dumps the traces, it never returns.
+static void *dumper_main(void *arg)
+{
+	sigset_t *signals = arg;
+
+	while (1) {
+		int sig = sigwaitinfo(signals, NULL);
+		if (sig < 0) {
+			if (errno == EINTR)
+				continue;
+			ERRNO_FATAL("sigwaitinfo");
+		}
+		dump_traces(sig == SIGUSR1);
+	}
+
+	return NULL;
+}
+
+void trace_init(void)
+{
+	static sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGUSR2);
+
+	// Threads created later inherit the mask, so only the dumper takes them.
+	int err = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	if (err == 0) {
+		pthread_t thread;
+		err = pthread_create(&thread, NULL, dumper_main, &signals);
+		if (err == 0)
+			pthread_detach(thread);
+	}
+	if (err != 0) {
+		errno = err;
+		ERRNO_FATAL("trace_init");
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <stdint.h>
+
+/* Per-request phase timing, compiled in only if CNSYNC_TRACE is defined.
+ * Each thread records timestamped phases of the connection it is currently
+ * serving into its own ring, which keeps the most recent TRACE_RING_SIZE
+ * records. Sending SIGUSR1 dumps all rings as Chrome trace JSON and SIGUSR2
+ * dumps them in a compact binary format, to cnsync-trace-<pid>.json or .bin
+ * in the working directory, from a thread of their own. Binary dumps have
+ * the magic "CNTRACE1", a 32-bit record size and 32 zero bits, followed by
+ * TraceRecords in host byte order.
+ * Without CNSYNC_TRACE all macros expand to nothing.
+ */
+
+enum TracePhase {
+	// Connection accepted, begins the connection span.
+	TRACE_ACCEPT,
+	// Event loop woke up for the connection.
+	TRACE_WAKE,
+	// First bytes of a request are available, begins the request span.
+	TRACE_FIRST_BYTE,
+	// Request header received and parsed, resource looked up.
+	TRACE_HEADER_PARSED,
+	// First queued segment written, it holds the response header.
+	TRACE_HEADER_WRITTEN,
+	// All of the response written, ends the request span.
+	TRACE_DRAINED,
+	// Connection closed, ends the connection span.
+	TRACE_CLOSE,
+	TRACE_PHASE_COUNT,
+};
+
+/// @brief A recorded phase, it is also the record of the binary format.
+typedef struct TraceRecord {
+	// CLOCK_MONOTONIC time in nanoseconds.
+	uint64_t time_ns;
+	// Slot of the connection in its server's connection table.
+	uint32_t conn;
+	uint8_t phase;
+	// Index of the recording thread, in order of their first record.
+	uint8_t thread;
+	uint16_t reserved;
+} TraceRecord;
+
+#ifdef CNSYNC_TRACE
+
+/// @brief Blocks the dump signals in the calling thread and starts the
+///        thread which takes them. It must be called before creating the
+///        threads that record, so that they inherit the blocked signals.
+void trace_init(void);
+
+/// @brief Sets the connection for which later phases are recorded.
+void trace_set_conn(uint32_t conn);
+
+/// @brief Records a phase of the current connection.
+void trace_record(enum TracePhase phase);
+
+#define TRACE_INIT() trace_init()
+#define TRACE_SET_CONN(conn) trace_set_conn(conn)
+#define TRACE_PHASE(phase) trace_record(phase)
+#define TRACE_CONN_PHASE(conn, phase) (trace_set_conn(conn), trace_record(phase))
+
+#else
+
+#define TRACE_INIT() ((void)0)
+#define TRACE_SET_CONN(conn) ((void)0)
+#define TRACE_PHASE(phase) ((void)0)
+#define TRACE_CONN_PHASE(conn, phase) ((void)0)
+
+#endif
+
+#endif
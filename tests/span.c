@@ -0,0 +1,170 @@
+/**
+ * @file span.c
+ * @brief Checks the SIMD scanning routines of the parser against the scalar one.
+ *
+ * For every character class and every length up to SPAN_LEN_MAX, a buffer of
+ * characters in the class gets each byte value at each position, so that the
+ * 16 and 32 byte chunk boundaries and the tails are all covered. Random
+ * buffers follow. Buffers are allocated with their exact length, so that
+ * sanitizers catch reads past the end. Routines the CPU does not support are
+ * skipped.
+ *
+ * Exits with a non-zero status and prints the first mismatch if any.
+ */
+
+#include "http/parser.c"
+
+enum SpanTestConfig {
+	SPAN_LEN_MAX = 64,
+	RANDOM_ROUNDS = 200000,
+};
+
+typedef struct SpanImpl {
+	const char *name;
+	SpanFunc span;
+} SpanImpl;
+
+static const char *const CLASS_NAMES[CLASS_COUNT] = {
+	[CLASS_NAME] = "CLASS_NAME",
+	[CLASS_URI] = "CLASS_URI",
+	[CLASS_NOT_CRLF] = "CLASS_NOT_CRLF",
+};
+
+static SpanImpl impls[3];
+static int impl_cnt = 0;
+
+// Characters of each class, fillers for the buffers.
+static unsigned char members[CLASS_COUNT][256];
+static int member_cnt[CLASS_COUNT];
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static uint32_t next_random(void)
+{
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545f4914f6cdd1d) >> 32;
+}
+
+static void dump_buffer(const char *buf, int len)
+{
+	for (int i = 0; i < len; ++i)
+		fprintf(stderr, "%02x%s", (unsigned char)buf[i], i + 1 < len ? " " : "\n");
+	if (len == 0)
+		fprintf(stderr, "(empty)\n");
+}
+
+/// @brief Runs every routine on the buffer and compares it with span_scalar.
+/// @return false on a mismatch.
+static bool check(enum CharClass cls, const char *buf, int len)
+{
+	const char *want = span_scalar(buf, buf + len, cls);
+
+	for (int i = 0; i < impl_cnt; ++i) {
+		const char *got = impls[i].span(buf, buf + len, cls);
+		if (got == want)
+			continue;
+
+		fprintf(
+			stderr, "%s: %s stops at %td, span_scalar at %td, length %d:\n",
+			impls[i].name, CLASS_NAMES[cls], got - buf, want - buf, len
+		);
+		dump_buffer(buf, len);
+		return false;
+	}
+	return true;
+}
+
+static void fill_members(enum CharClass cls, char *buf, int len)
+{
+	for (int i = 0; i < len; ++i)
+		buf[i] = members[cls][next_random() % member_cnt[cls]];
+}
+
+/// @brief Puts every byte value at every position of buffers in the class.
+static bool check_edges(enum CharClass cls)
+{
+	for (int len = 0; len <= SPAN_LEN_MAX; ++len) {
+		// At least one byte, malloc(0) may return NULL.
+		char *buf = malloc(len > 0 ? len : 1);
+		if (buf == NULL)
+			ERRNO_FATAL("malloc");
+
+		fill_members(cls, buf, len);
+		bool ok = check(cls, buf, len);
+
+		for (int pos = 0; ok && pos < len; ++pos) {
+			for (int c = 0; ok && c < 256; ++c) {
+				fill_members(cls, buf, len);
+				buf[pos] = (char)c;
+				ok = check(cls, buf, len);
+			}
+		}
+
+		free(buf);
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+/// @brief Checks random buffers, mostly of characters in the class, with
+///        random bytes, CR, LF and bytes with the high bit set mixed in.
+static bool check_random(enum CharClass cls)
+{
+	static const unsigned char SPECIAL[] = {'\r', '\n', ' ', '\t', 0x00, 0x7f, 0x80, 0xff};
+
+	for (int round = 0; round < RANDOM_ROUNDS; ++round) {
+		int len = next_random() % (SPAN_LEN_MAX + 1);
+		char *buf = malloc(len > 0 ? len : 1);
+		if (buf == NULL)
+			ERRNO_FATAL("malloc");
+
+		// One in 64 bytes on average is not drawn from the class.
+		uint32_t odds = 1 + next_random() % 64;
+		for (int i = 0; i < len; ++i) {
+			uint32_t r = next_random();
+			if (r % odds != 0)
+				buf[i] = members[cls][r / odds % member_cnt[cls]];
+			else if (r & 0x100)
+				buf[i] = SPECIAL[(r >> 9) % sizeof SPECIAL];
+			else
+				buf[i] = (char)(r >> 9);
+		}
+
+		bool ok = check(cls, buf, len);
+		free(buf);
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+int main(void)
+{
+	impls[impl_cnt++] = (SpanImpl){"span_class", span_class};
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("sse4.2"))
+		impls[impl_cnt++] = (SpanImpl){"span_sse42", span_sse42};
+	if (__builtin_cpu_supports("avx2"))
+		impls[impl_cnt++] = (SpanImpl){"span_avx2", span_avx2};
+#endif
+
+	for (int cls = 0; cls < CLASS_COUNT; ++cls) {
+		for (int c = 0; c < 256; ++c) {
+			if (in_class(cls, c))
+				members[cls][member_cnt[cls]++] = c;
+		}
+	}
+
+	for (int cls = 0; cls < CLASS_COUNT; ++cls) {
+		if (!check_edges(cls) || !check_random(cls))
+			return EXIT_FAILURE;
+	}
+
+	for (int i = 0; i < impl_cnt; ++i)
+		printf("%s matches span_scalar\n", impls[i].name);
+	return EXIT_SUCCESS;
+}